@@ -0,0 +1,188 @@
+/************************************************************************
+ * libserial AT command responses
+ *
+ * Lines are found with serial_find_char and compared with
+ * serial_compare_data_P, so the receive buffer is the only copy.
+ ************************************************************************/
+
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "serial.h"
+#include "at.h"
+
+#ifdef TX_ONLY
+#error "at.c reads the receive buffer"
+#endif
+
+
+/************************************************************************
+ * Private functions
+ ************************************************************************/
+
+/************************************************************************
+ * match_line: find the table entry for the line at the front
+ *
+ * Parameters:
+ *		const struct at_response *table	Expected responses, in flash
+ *		uint8_t count					Entries in table
+ *		uint16_t length					Length of the line, without CR LF
+ *		uint16_t *matched				Where to store the matched length
+ *
+ * Returns: index of the first matching entry, or AT_NONE
+ ************************************************************************/
+
+static uint8_t match_line(const struct at_response *table, uint8_t count,
+	uint16_t length, uint16_t *matched)
+{
+
+	const char *text;
+	uint16_t text_length;
+	uint8_t i;
+
+	for (i = 0; i < count; i++) {
+
+		text = pgm_read_ptr(&table[i].text);
+		text_length = strlen_P(text);
+
+		if (text_length > length)
+			continue;
+		if (text_length != length &&
+			!(pgm_read_byte(&table[i].flags) & AT_LINE_PREFIX))
+			continue;
+
+		if (serial_compare_data_P(text, text_length) == SERIAL_OK) {
+			*matched = text_length;
+			return i;
+		}
+
+	}
+
+	return AT_NONE;
+
+}
+
+
+/************************************************************************
+ * Public functions
+ ************************************************************************/
+
+/************************************************************************
+ * at_get_response: recognise the next response line
+ *
+ * Parameters:
+ *		const struct at_response *table	Expected responses, in flash
+ *		uint8_t count					Entries in table
+ *		struct at_line *line			Where to describe the line
+ *
+ * Returns:
+ *		uint8_t index	Matching table entry, or AT_NONE
+ *
+ * A line that fills the whole receive buffer without ending can never
+ * be matched, so it is dropped to make room.
+ ************************************************************************/
+
+extern uint8_t at_get_response(const struct at_response *table, uint8_t count,
+	struct at_line *line)
+{
+
+	int16_t end;
+	uint16_t length, matched;
+	uint8_t data, index;
+
+	while (1) {
+
+		if ((end = serial_find_char('\n')) < 0) {
+			if (serial_data_pending() >= RX_BUFFER_SIZE)
+				serial_drop_data(RX_BUFFER_SIZE);
+			return AT_NONE;
+		}
+
+		length = end;
+		if (length && serial_peek_char(length - 1, &data) == SERIAL_OK && data == '\r')
+			length--;
+
+		if (length && (index = match_line(table, count, length, &matched)) != AT_NONE) {
+
+			// Arguments start after "+CMD:" and a space
+			if (matched < length && serial_peek_char(matched, &data) == SERIAL_OK &&
+				data == ' ')
+				matched++;
+
+			line->arguments = matched;
+			line->end = length;
+			line->size = end + 1;
+
+			return index;
+
+		}
+
+		// Empty line, echo, or nothing we are waiting for
+		serial_drop_data(end + 1);
+
+	}
+
+}
+
+/************************************************************************
+ * at_get_number: read a decimal argument of a line
+ *
+ * Parameters:
+ *		struct at_line *line	The line
+ *		uint16_t *offset		Where to start, moved past the number
+ *		int16_t *value			Where to store the number
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if there is no number at offset
+ ************************************************************************/
+
+extern return_code_t at_get_number(struct at_line *line, uint16_t *offset, int16_t *value)
+{
+
+	uint16_t position = *offset;
+	uint8_t negative = 0;
+	uint8_t digits = 0;
+	int16_t number = 0;
+	uint8_t data;
+
+	if (position < line->end && serial_peek_char(position, &data) == SERIAL_OK &&
+		data == '-') {
+		negative = 1;
+		position++;
+	}
+
+	while (position < line->end && serial_peek_char(position, &data) == SERIAL_OK &&
+		data >= '0' && data <= '9') {
+		number = number * 10 + (data - '0');
+		position++;
+		digits++;
+	}
+
+	if (!digits)
+		return SERIAL_ERROR;
+
+	// On to the next argument
+	if (position < line->end && serial_peek_char(position, &data) == SERIAL_OK &&
+		data == ',')
+		position++;
+
+	*offset = position;
+	*value = negative ? -number : number;
+
+	return SERIAL_OK;
+
+}
+
+/************************************************************************
+ * at_release_line: take a line out of the receive buffer
+ ************************************************************************/
+
+extern void at_release_line(struct at_line *line)
+{
+
+	serial_drop_data(line->size);
+
+}
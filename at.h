@@ -0,0 +1,96 @@
+/************************************************************************
+ * libserial AT command responses
+ *
+ * Recognises modem response lines where they sit in the receive buffer,
+ * against a table in flash. Include serial.h before this file.
+ ************************************************************************/
+
+#define AT_LINE_PREFIX				0x01		// Entry only has to start the line
+
+#define AT_NONE						0xff		// No line, from at_get_response
+
+/************************************************************************
+ * struct at_response: an expected response, for a PROGMEM table
+ *
+ * Members:
+ *		const char *text	Response text, in flash as well
+ *		uint8_t flags		AT_LINE_PREFIX for responses with arguments
+ *							("+CSQ:"), 0 for whole lines ("OK")
+ *
+ * e.g.
+ *		static const char at_ok[] PROGMEM = "OK";
+ *		static const char at_csq[] PROGMEM = "+CSQ:";
+ *		static const struct at_response responses[] PROGMEM = {
+ *			{at_ok, 0},
+ *			{at_csq, AT_LINE_PREFIX},
+ *		};
+ ************************************************************************/
+
+struct at_response {
+	const char *text;
+	uint8_t flags;
+};
+
+/************************************************************************
+ * struct at_line: a recognised line, still in the receive buffer
+ *
+ * Members:
+ *		uint16_t arguments	Offset of what follows the matched text (and
+ *							one space), for serial_peek_char
+ *		uint16_t end		Offset of the line end
+ *		uint16_t size		Bytes taken by the line, including CR LF
+ ************************************************************************/
+
+struct at_line {
+	uint16_t arguments;
+	uint16_t end;
+	uint16_t size;
+};
+
+/************************************************************************
+ * at_get_response: recognise the next response line
+ *
+ * Parameters:
+ *		const struct at_response *table	Expected responses, in flash
+ *		uint8_t count					Entries in table
+ *		struct at_line *line			Where to describe the line
+ *
+ * Returns:
+ *		uint8_t index	Table entry the next complete line matches, or
+ *						AT_NONE if there is no complete line yet
+ *
+ * Lines are compared in place, without copying. Empty lines, command
+ * echo and lines that match no entry are dropped. A matched line stays
+ * at the front of the receive buffer, to read its arguments, until
+ * at_release_line is called.
+ ************************************************************************/
+
+extern uint8_t at_get_response(const struct at_response *table, uint8_t count,
+	struct at_line *line);
+
+/************************************************************************
+ * at_get_number: read a decimal argument of a line
+ *
+ * Parameters:
+ *		struct at_line *line	The line
+ *		uint16_t *offset		Where to start, moved past the number and
+ *								a ',' after it. Start at line->arguments.
+ *		int16_t *value			Where to store the number
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if there is no number at offset
+ ************************************************************************/
+
+extern return_code_t at_get_number(struct at_line *line, uint16_t *offset, int16_t *value);
+
+/************************************************************************
+ * at_release_line: take a line out of the receive buffer
+ *
+ * Parameters:
+ *		struct at_line *line	The line, from at_get_response
+ *
+ * Returns: nothing
+ ************************************************************************/
+
+extern void at_release_line(struct at_line *line);
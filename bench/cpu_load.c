@@ -0,0 +1,113 @@
+/************************************************************************
+ * CPU load benchmark
+ *
+ * Counts main loop iterations of fw_cpu_load (PB3 toggles) over a fixed
+ * window, once for the calibration build of the traffic mix, which runs
+ * the same loop body with the library's interrupts masked, and once for
+ * the build under test. The share of iterations lost is the CPU the
+ * ISRs take, including main loop waits on them. The polling calls
+ * themselves are in both runs, so they do not count. With rx set, the
+ * host sends back to back frames, and a run where the device read none
+ * (PB4 toggles) is an error.
+ *
+ * Usage: cpu_load calibrate.elf firmware.elf baud rx
+ ************************************************************************/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <simavr/sim_avr.h>
+#include <simavr/avr_ioport.h>
+#include "sim_uart.h"
+
+#define F_CPU			8000000
+#define RX_PIN			1
+#define COUNTER_PIN		3
+#define RECEIVED_PIN	4
+#define WARMUP			(F_CPU / 100)		// 10 ms
+#define WINDOW			(F_CPU / 4)			// 250 ms
+
+static void on_counter(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+
+	(*(uint32_t *)param)++;
+
+}
+
+/************************************************************************
+ * count_iterations: run a firmware and count main loop iterations
+ *
+ * Returns:
+ *		Iterations in the window, or 0 on error
+ ************************************************************************/
+
+static uint32_t count_iterations(const char *path, uint32_t baud, int rx,
+	uint32_t *received)
+{
+
+	struct sim_uart uart = {0};
+	uint32_t count = 0;
+	uint32_t start;
+	avr_t *avr;
+
+	*received = 0;
+
+	if ((avr = sim_load_device(path, F_CPU)) == NULL)
+		return 0;
+
+	avr_irq_register_notify(
+		avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), COUNTER_PIN),
+		on_counter, &count);
+	avr_irq_register_notify(
+		avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), RECEIVED_PIN),
+		on_counter, received);
+
+	sim_uart_init(&uart, avr, baud, RX_PIN);
+
+	if (sim_run_until(avr, WARMUP))
+		return 0;
+
+	start = count;
+	while (avr->cycle < WARMUP + WINDOW) {
+		// Back to back frames, no gap
+		while (rx && sim_uart_send(&uart, rand()) == 0);
+		if (sim_run_until(avr, avr->cycle + 64 * uart.bit))
+			return 0;
+	}
+
+	return count - start;
+
+}
+
+int main(int argc, char *argv[])
+{
+
+	uint32_t reference;
+	uint32_t loaded;
+	uint32_t received;
+	int rx;
+
+	if (argc < 5) {
+		fprintf(stderr, "usage: %s calibrate.elf firmware.elf baud rx\n", argv[0]);
+		return 2;
+	}
+	rx = atoi(argv[4]);
+
+	if (!(reference = count_iterations(argv[1], atol(argv[3]), 0, &received))) {
+		printf(" error");
+		return 2;
+	}
+	loaded = count_iterations(argv[2], atol(argv[3]), rx, &received);
+
+	// A stalled main loop or a device that read nothing is a broken run,
+	// not 100% load
+	if (!loaded || (rx && !received)) {
+		printf(" error");
+		return 2;
+	}
+
+	printf("%5.1f%%", 100.0 * (1.0 - (double)loaded / reference));
+
+	return 0;
+
+}
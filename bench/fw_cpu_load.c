@@ -0,0 +1,65 @@
+/************************************************************************
+ * CPU load benchmark firmware
+ *
+ * The main loop toggles PB3 once per iteration, so the host can count
+ * how many iterations the library leaves room for. Per build:
+ *
+ *		BENCH_TX		Keep the TX buffer full (TX saturated)
+ *		BENCH_RX		Drain the RX buffer (host saturates RX), toggling
+ *						PB4 for every byte read
+ *		BENCH_CALIBRATE	Same loop body, with the library set up but its
+ *						interrupts masked: the reference for the mix
+ ************************************************************************/
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdlib.h>
+
+#include "serial.h"
+
+#ifndef BENCH_SPEED
+#define BENCH_SPEED		SERIAL_SPEED_9600
+#endif
+
+int main(void)
+{
+
+	struct serial_init serial_init = {"PB1", "PB2", BENCH_SPEED};
+
+	DDRB |= (1 << PB3) | (1 << PB4);
+
+	if (serial_initialise(&serial_init) != SERIAL_OK)
+		return 1;
+
+#ifdef BENCH_CALIBRATE
+	// The API calls below still run, but no ISR ever does. TX fills up
+	// and then fails, RX never has data, as in the loaded runs apart
+	// from the ISR work. serial_put_char sets the I flag, so mask the
+	// sources rather than rely on cli()
+	TIMSK &= ~(1 << OCIE1A);
+#else
+	serial_enable_receive();
+#endif
+	sei();
+
+	while (1) {
+
+		PINB = (1 << PB3);		// Idle counter
+
+#ifdef BENCH_TX
+		serial_put_char(0x55);	// Fails quietly while the buffer is full
+#endif
+
+#ifdef BENCH_RX
+		if (serial_data_pending()) {
+			serial_get_char();
+			PINB = (1 << PB4);	// Received counter
+		}
+#endif
+
+	}
+
+	return 0;
+
+}
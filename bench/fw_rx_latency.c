@@ -0,0 +1,55 @@
+/************************************************************************
+ * RX latency benchmark firmware
+ *
+ * Receives on PB1 and toggles PB0 as soon as serial_get_char() returns,
+ * so the host can timestamp delivery to the main loop. The byte itself
+ * goes to GPIOR0 for the host to identify the frame. BENCH_LOAD sets
+ * the amount of busy work the main loop does between polls.
+ ************************************************************************/
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdlib.h>
+
+#include "serial.h"
+
+#ifndef BENCH_SPEED
+#define BENCH_SPEED		SERIAL_SPEED_9600
+#endif
+
+#ifndef BENCH_LOAD
+#define BENCH_LOAD		0		// Busy loop iterations between polls
+#endif
+
+static volatile uint8_t work;
+
+int main(void)
+{
+
+	struct serial_init serial_init = {"PB1", NULL, BENCH_SPEED};
+	uint16_t i;
+
+	DDRB |= (1 << PB0);
+
+	if (serial_initialise(&serial_init) != SERIAL_OK)
+		return 1;
+
+	serial_enable_receive();
+	sei();
+
+	while (1) {
+
+		if (serial_data_pending()) {
+			GPIOR0 = serial_get_char();
+			PINB = (1 << PB0);		// Toggle marker
+		}
+
+		for (i = 0; i < BENCH_LOAD; i++)
+			work++;
+
+	}
+
+	return 0;
+
+}
@@ -0,0 +1,65 @@
+/************************************************************************
+ * Full duplex stress firmware
+ *
+ * Echoes every received byte as fast as the link allows. Build with
+ * -DRX_BUFFER_SIZE and -DTX_BUFFER_SIZE to try other buffer sizes.
+ *
+ * With -DBENCH_RESERVE the echo is written straight into the TX buffer
+ * with serial_reserve_data and serial_commit_data, as rpc.c and mux.c
+ * reply. At line rate a byte is nearly always on the wire while the
+ * buffer is locked, so the TX path has to get through stop bits that
+ * find it locked.
+ ************************************************************************/
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdlib.h>
+
+#include "serial.h"
+
+#ifndef BENCH_SPEED
+#define BENCH_SPEED		SERIAL_SPEED_9600
+#endif
+
+int main(void)
+{
+
+	struct serial_init serial_init = {"PB1", "PB2", BENCH_SPEED};
+#ifdef BENCH_RESERVE
+	uint16_t pending, room, i;
+	uint8_t *out;
+#else
+	uint8_t data;
+#endif
+
+	if (serial_initialise(&serial_init) != SERIAL_OK)
+		return 1;
+
+	serial_enable_receive();
+	sei();
+
+	while (1) {
+
+#ifdef BENCH_RESERVE
+		if ((pending = serial_data_pending()) != 0) {
+			out = serial_reserve_data(&room);
+			if (pending > room)
+				pending = room;
+			for (i = 0; i < pending; i++)
+				serial_peek_char(i, &out[i]);
+			serial_commit_data(pending);
+			serial_drop_data(pending);
+		}
+#else
+		if (serial_data_pending()) {
+			data = serial_get_char();
+			while (serial_put_char(data) == SERIAL_ERROR);
+		}
+#endif
+
+	}
+
+	return 0;
+
+}
@@ -0,0 +1,15 @@
+/************************************************************************
+ * Host stand-in for <avr/interrupt.h>
+ *
+ * The timer tick is SIGALRM, so disabling interrupts blocks it. Inside
+ * the tick the signal is blocked already, and sei() leaves it that way,
+ * as the AVR does not nest interrupts unless told to.
+ ************************************************************************/
+
+#define ISR(vector)	void vector(void)
+
+extern void host_cli(void);
+extern void host_sei(void);
+
+#define cli()		host_cli()
+#define sei()		host_sei()
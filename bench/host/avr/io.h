@@ -0,0 +1,35 @@
+/************************************************************************
+ * Host stand-in for <avr/io.h>
+ *
+ * The ATtiny85 registers libserial and the bench firmware touch, as
+ * plain variables defined in host_stress.c. Nothing behind them: the
+ * harness plays the timer, the pin change logic and the line.
+ ************************************************************************/
+
+#include <stdint.h>
+
+extern volatile uint8_t DDRB, PORTB, PINB;
+extern volatile uint8_t GIMSK, GIFR, PCMSK;
+extern volatile uint8_t TIMSK, TIFR, TCCR1, TCNT1, OCR1A, OCR1C;
+extern volatile uint8_t SREG, GPIOR0;
+
+#define PB0			0
+#define PB1			1
+#define PB2			2
+#define PB3			3
+#define PB4			4
+#define PB5			5
+
+#define PCIE		5
+#define PCIF		5
+#define OCIE1A		6
+#define OCF1A		6
+#define CTC1		7
+#define CS13		3
+#define CS12		2
+#define CS11		1
+#define CS10		0
+
+// As avr-libc: sfr is the register itself, its address is what is read
+#define bit_is_set(sfr, bit)	(*(volatile uint8_t *)&(sfr) & (1 << (bit)))
+#define bit_is_clear(sfr, bit)	(!bit_is_set(sfr, bit))
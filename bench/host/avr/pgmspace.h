@@ -0,0 +1,10 @@
+/************************************************************************
+ * Host stand-in for <avr/pgmspace.h>: flash is ordinary memory
+ ************************************************************************/
+
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s)				(s)
+#define pgm_read_byte(a)	(*(const uint8_t *)(a))
+#define memcmp_P			memcmp
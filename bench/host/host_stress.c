@@ -0,0 +1,367 @@
+/************************************************************************
+ * Host run of the stress firmware
+ *
+ * Builds fw_stress.c and the library for the host, with the stand-ins
+ * for the AVR headers in bench/host, and runs it against a simulated
+ * peer. SIGALRM is the Timer1 tick. Each one drives the peer's line onto
+ * PB1, runs PCINT0_vect on an edge as the pin change interrupt would,
+ * runs TIM1_COMPA_vect and decodes what the device sends on PB2. The
+ * firmware's main() runs unchanged in between.
+ *
+ * Frames and accounting are those of stress_test.c. This checks that
+ * the RX and TX paths neither lose nor corrupt anything at line rate.
+ * Between ticks the host runs far more code than an ATtiny85 would, so
+ * it says nothing about timing: rx-latency and cpu-load only run under
+ * simavr.
+ *
+ * Environment:
+ *		HOST_FRAMES			Frames to send (default 500)
+ *		HOST_SEI_DELAY_US	Busy time after each sei() in the main loop.
+ *							Slows the firmware down against the ticks,
+ *							so ticks land inside its locked sections,
+ *							e.g. a stop bit while BENCH_RESERVE holds the
+ *							TX buffer.
+ ************************************************************************/
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#define TICK_US			50			// Host time per Timer1 tick
+#define TICKS_PER_BIT	2
+#define RX_PIN			1
+#define TX_PIN			2
+
+#define FRAME_START		0x7e
+#define PAYLOAD_SIZE	6
+#define FRAME_SIZE		(1 + 1 + PAYLOAD_SIZE + 2)
+#define SEQ_MODULO		0x7e
+
+#define DRAIN_TICKS		(256 * 10 * TICKS_PER_BIT)
+#define QUEUE_SIZE		64			// Peer bytes waiting, power of 2
+
+// The registers behind <avr/io.h>
+volatile uint8_t DDRB, PORTB, PINB;
+volatile uint8_t GIMSK, GIFR, PCMSK;
+volatile uint8_t TIMSK, TIFR, TCCR1, TCNT1, OCR1A, OCR1C;
+volatile uint8_t SREG, GPIOR0;
+
+extern void PCINT0_vect(void);
+extern void TIM1_COMPA_vect(void);
+
+struct stats {
+	uint32_t frames_sent;
+	uint32_t frames_good;
+	uint32_t frames_lost;
+	uint32_t frames_corrupt;
+	uint32_t bytes_sent;
+	uint32_t bytes_received;
+	uint32_t framing_errors;
+};
+
+static struct stats stats;
+static uint32_t frames_wanted = 500;
+static long sei_delay_ns = 0;
+static volatile sig_atomic_t in_tick = 0;
+static uint32_t ticks = 0;
+static uint32_t idle_ticks = 0;
+
+// Peer sending on PB1
+static uint8_t queue[QUEUE_SIZE];
+static uint8_t queue_head = 0;
+static uint8_t queue_count = 0;
+static int8_t send_bit = -1;		// Start bit 0, data 1 to 8, stop 9
+static uint8_t send_phase = 0;
+static uint8_t send_byte;
+
+// Echo coming back on PB2
+static int8_t receive_bit = -1;
+static uint8_t receive_phase = 0;
+static uint8_t receive_byte;
+static uint8_t frame[FRAME_SIZE];
+static uint8_t frame_length = 0;
+static int16_t expected_seq = -1;
+
+
+/************************************************************************
+ * Interrupt flag
+ ************************************************************************/
+
+extern void host_cli(void)
+{
+
+	sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGALRM);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+
+}
+
+extern void host_sei(void)
+{
+
+	struct timespec start, now;
+	sigset_t set;
+
+	if (in_tick)
+		return;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGALRM);
+	sigprocmask(SIG_UNBLOCK, &set, NULL);
+
+	if (!sei_delay_ns)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while ((now.tv_sec - start.tv_sec) * 1000000000L +
+		now.tv_nsec - start.tv_nsec < sei_delay_ns);
+
+}
+
+
+/************************************************************************
+ * Frames, as in stress_test.c
+ ************************************************************************/
+
+static uint8_t crc8(uint8_t *data, uint8_t length)
+{
+
+	uint8_t crc = 0;
+	uint8_t i;
+
+	while (length--) {
+		crc ^= *data++;
+		for (i = 0; i < 8; i++)
+			crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+	}
+
+	return crc;
+
+}
+
+static void check_frame(void)
+{
+
+	uint8_t crc;
+
+	if (!frame_length)
+		return;
+
+	crc = frame[FRAME_SIZE - 2] << 4 | frame[FRAME_SIZE - 1];
+	if (frame_length != FRAME_SIZE || crc != crc8(frame + 1, 1 + PAYLOAD_SIZE)) {
+		stats.frames_corrupt++;
+		if (expected_seq >= 0)
+			expected_seq = (expected_seq + 1) % SEQ_MODULO;
+		return;
+	}
+
+	if (expected_seq >= 0)
+		stats.frames_lost += (frame[1] - expected_seq + SEQ_MODULO) % SEQ_MODULO;
+	expected_seq = (frame[1] + 1) % SEQ_MODULO;
+	stats.frames_good++;
+
+}
+
+static void on_receive(uint8_t data, uint8_t stop_bit)
+{
+
+	stats.bytes_received++;
+	if (!stop_bit)
+		stats.framing_errors++;
+
+	if (data == FRAME_START) {
+		check_frame();
+		frame_length = 0;
+	}
+
+	if (frame_length < FRAME_SIZE)
+		frame[frame_length] = data;
+	if (frame_length < 255)
+		frame_length++;
+
+}
+
+static void queue_frame(void)
+{
+
+	uint8_t out[FRAME_SIZE];
+	uint8_t crc;
+	uint8_t i;
+
+	out[0] = FRAME_START;
+	out[1] = stats.frames_sent % SEQ_MODULO;
+	for (i = 0; i < PAYLOAD_SIZE; i++)
+		out[2 + i] = rand() % FRAME_START;
+	crc = crc8(out + 1, 1 + PAYLOAD_SIZE);
+	out[FRAME_SIZE - 2] = crc >> 4;
+	out[FRAME_SIZE - 1] = crc & 0x0f;
+
+	for (i = 0; i < FRAME_SIZE; i++)
+		queue[(queue_head + queue_count++) & (QUEUE_SIZE - 1)] = out[i];
+
+	stats.frames_sent++;
+	stats.bytes_sent += FRAME_SIZE;
+
+}
+
+
+/************************************************************************
+ * The line
+ ************************************************************************/
+
+/************************************************************************
+ * drive_line: put the peer's next half bit on PB1
+ *
+ * Back to back frames, no idle bits between them.
+ ************************************************************************/
+
+static void drive_line(void)
+{
+
+	uint8_t level = 1;
+	uint8_t old = PINB;
+
+	if (send_phase == 0) {
+		if (send_bit < 0 && queue_count) {
+			send_byte = queue[queue_head];
+			queue_head = (queue_head + 1) & (QUEUE_SIZE - 1);
+			queue_count--;
+			send_bit = 0;
+		}
+		if (send_bit == 0)
+			level = 0;
+		else if (send_bit > 0 && send_bit < 9)
+			level = (send_byte >> (send_bit - 1)) & 1;
+		if (level)
+			PINB |= (1 << RX_PIN);
+		else
+			PINB &= ~(1 << RX_PIN);
+	}
+
+	if (send_bit >= 0 && ++send_phase == TICKS_PER_BIT) {
+		send_phase = 0;
+		if (++send_bit == 10)
+			send_bit = -1;
+	}
+
+	// The edge lands a third into the tick
+	if ((old ^ PINB) & (1 << RX_PIN) && (GIMSK & (1 << PCIE)) &&
+		(PCMSK & (1 << RX_PIN))) {
+		TCNT1 = OCR1C / 3;
+		PCINT0_vect();
+	}
+
+}
+
+/************************************************************************
+ * sample_line: decode PB2, sampling each bit at its last tick
+ ************************************************************************/
+
+static void sample_line(void)
+{
+
+	uint8_t level = (PORTB >> TX_PIN) & 1;
+
+	if (receive_bit < 0) {
+		if (!level) {
+			receive_bit = 0;
+			receive_phase = 0;
+			receive_byte = 0;
+		}
+		return;
+	}
+
+	if (++receive_phase < TICKS_PER_BIT)
+		return;
+	receive_phase = 0;
+
+	if (receive_bit < 8) {
+		receive_byte |= level << receive_bit++;
+	} else {
+		on_receive(receive_byte, level);
+		receive_bit = -1;
+	}
+
+}
+
+static void report(void)
+{
+
+	check_frame();
+
+	printf("sent %6u frames, good %6u, lost %5u (%u in gaps), corrupt %5u, "
+		"bytes lost %6d, framing errors %4u\n",
+		stats.frames_sent, stats.frames_good,
+		stats.frames_sent - stats.frames_good - stats.frames_corrupt,
+		stats.frames_lost, stats.frames_corrupt,
+		(int)(stats.bytes_sent - stats.bytes_received),
+		stats.framing_errors);
+
+	exit(stats.frames_good == stats.frames_sent && !stats.framing_errors ? 0 : 1);
+
+}
+
+static void tick(int signal)
+{
+
+	in_tick = 1;
+	ticks++;
+
+	while (stats.frames_sent < frames_wanted &&
+		QUEUE_SIZE - queue_count >= FRAME_SIZE)
+		queue_frame();
+
+	drive_line();
+
+	if ((TIMSK & (1 << OCIE1A)) && (TCCR1 & 0x0f)) {
+		TCNT1 = 0;
+		TIM1_COMPA_vect();
+	}
+
+	sample_line();
+
+	// Done once everything is sent and the echo has had time to drain
+	if (stats.frames_sent == frames_wanted && !queue_count && send_bit < 0 &&
+		receive_bit < 0 && ++idle_ticks > DRAIN_TICKS)
+		report();
+
+	in_tick = 0;
+
+}
+
+/************************************************************************
+ * host_start: set the harness going before the firmware's main()
+ *
+ * Interrupts start off, as after reset, until the firmware calls sei().
+ ************************************************************************/
+
+static void __attribute__((constructor)) host_start(void)
+{
+
+	struct itimerval timer = {{0, TICK_US}, {0, TICK_US}};
+	struct sigaction action = {0};
+	char *frames = getenv("HOST_FRAMES");
+	char *delay = getenv("HOST_SEI_DELAY_US");
+
+	if (frames)
+		frames_wanted = atol(frames);
+	if (delay)
+		sei_delay_ns = atol(delay) * 1000L;
+	srand(1);
+
+	PINB = (1 << RX_PIN);	// Idle line
+
+	host_cli();
+	action.sa_handler = tick;
+	sigaction(SIGALRM, &action, NULL);
+	setitimer(ITIMER_REAL, &timer, NULL);
+
+}
@@ -0,0 +1,39 @@
+/************************************************************************
+ * Host stand-in for <util/atomic.h>
+ *
+ * Blocks the SIGALRM tick for the block and puts the old signal mask
+ * back after it. Only ATOMIC_RESTORESTATE is used by libserial, so the
+ * type argument is ignored. Leaving the block with break or return
+ * skips the restore, unlike avr-libc: libserial does neither.
+ ************************************************************************/
+
+#include <signal.h>
+
+static inline int host_atomic_start(sigset_t *saved)
+{
+
+	sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGALRM);
+	sigprocmask(SIG_BLOCK, &set, saved);
+
+	return 1;
+
+}
+
+static inline int host_atomic_end(sigset_t *saved)
+{
+
+	sigprocmask(SIG_SETMASK, saved, NULL);
+
+	return 0;
+
+}
+
+#define ATOMIC_RESTORESTATE
+
+#define ATOMIC_BLOCK(type) \
+	for (sigset_t host_saved_, *host_once_ = \
+			host_atomic_start(&host_saved_) ? &host_saved_ : NULL; \
+		host_once_; host_once_ = host_atomic_end(&host_saved_) ? host_once_ : NULL)
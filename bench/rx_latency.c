@@ -0,0 +1,142 @@
+/************************************************************************
+ * RX latency benchmark
+ *
+ * Runs fw_rx_latency under simavr, sends it numbered frames and
+ * measures the time from the start of each stop bit on the wire until
+ * the main loop has the byte (the firmware toggles PB0). That includes
+ * stop bit sampling, the store in TIM1_COMPA_vect and the wait for the
+ * bottom handler in wait_buffer_clean.
+ *
+ * Frame n carries the byte n & 0xff, which the firmware leaves in
+ * GPIOR0, so lost frames do not throw off the matching.
+ *
+ * Usage: rx_latency firmware.elf baud [frames [gap]]
+ ************************************************************************/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <simavr/sim_avr.h>
+#include <simavr/avr_ioport.h>
+#include "sim_uart.h"
+
+#define F_CPU			8000000
+#define RX_PIN			1
+#define MARKER_PIN		0
+#define MAX_FRAMES		4096
+#define GPIOR0_ADDRESS	0x31		// Data space address of GPIOR0
+
+static avr_cycle_count_t stop_bits[MAX_FRAMES];
+static avr_cycle_count_t latencies[MAX_FRAMES];
+static uint16_t frames_sent = 0;
+static uint16_t frames_seen = 0;
+static uint16_t next_frame = 0;		// First frame not matched yet
+
+static void on_stop_bit(struct sim_uart *uart, uint8_t data, avr_cycle_count_t when)
+{
+
+	if (frames_sent < MAX_FRAMES)
+		stop_bits[frames_sent++] = when;
+
+}
+
+static void on_marker(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+
+	avr_t *avr = param;
+	uint8_t data = avr->data[GPIOR0_ADDRESS];
+	uint16_t frame;
+
+	// Bytes arrive in order, so this is the first unmatched frame that
+	// carries data. Skipped frames were lost.
+	for (frame = next_frame; frame < frames_sent; frame++) {
+		if ((frame & 0xff) == data) {
+			latencies[frames_seen++] = avr->cycle - stop_bits[frame];
+			next_frame = frame + 1;
+			return;
+		}
+	}
+
+}
+
+static int compare_cycles(const void *a, const void *b)
+{
+
+	avr_cycle_count_t x = *(const avr_cycle_count_t *)a;
+	avr_cycle_count_t y = *(const avr_cycle_count_t *)b;
+
+	return (x > y) - (x < y);
+
+}
+
+int main(int argc, char *argv[])
+{
+
+	struct sim_uart uart = {0};
+	avr_t *avr;
+	uint32_t baud;
+	uint16_t frames = 256;
+	uint16_t i;
+	int state;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s firmware.elf baud [frames [gap]]\n", argv[0]);
+		return 2;
+	}
+	baud = atol(argv[2]);
+	if (argc > 3)
+		frames = atoi(argv[3]);
+	if (frames > MAX_FRAMES)
+		frames = MAX_FRAMES;
+
+	if ((avr = sim_load_device(argv[1], F_CPU)) == NULL)
+		return 2;
+
+	avr_irq_register_notify(
+		avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), MARKER_PIN),
+		on_marker, avr);
+
+	sim_uart_init(&uart, avr, baud, RX_PIN);
+	uart.gap = argc > 4 ? atoi(argv[4]) : 1;
+	uart.on_stop_bit = on_stop_bit;
+
+	// Let the firmware initialise before the first start bit
+	if (sim_run_until(avr, F_CPU / 1000))
+		return 2;
+
+	// Keep the peer's queue topped up until everything is sent
+	i = 0;
+	do {
+		while (i < frames && sim_uart_send(&uart, i) == 0)
+			i++;
+		state = avr_run(avr);
+	} while (state != cpu_Done && state != cpu_Crashed &&
+		(i < frames || sim_uart_pending(&uart) || uart.busy));
+
+	// Plus a couple of frame times for bytes still in the buffer
+	if (state == cpu_Done || state == cpu_Crashed ||
+		sim_run_until(avr, avr->cycle + 20 * uart.bit))
+		return 2;
+
+	if (!frames_seen) {
+		printf("%6u baud: no bytes received, %u lost\n", baud, frames_sent);
+		return 1;
+	}
+
+	qsort(latencies, frames_seen, sizeof(latencies[0]), compare_cycles);
+
+	// Latencies in microseconds
+#define US(c)	((double)(c) * 1e6 / F_CPU)
+	printf("%6u baud: %4u frames, %4u lost, latency us min %7.1f "
+		"median %7.1f p90 %7.1f p99 %7.1f max %7.1f (bit %.1f)\n",
+		baud, frames_sent, frames_sent - frames_seen,
+		US(latencies[0]),
+		US(latencies[frames_seen / 2]),
+		US(latencies[frames_seen * 9 / 10]),
+		US(latencies[frames_seen * 99 / 100]),
+		US(latencies[frames_seen - 1]),
+		US(uart.bit));
+
+	return 0;
+
+}
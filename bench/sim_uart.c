@@ -0,0 +1,206 @@
+/************************************************************************
+ * sim_uart
+ *
+ * Host side UART peer for libserial benchmarks under simavr
+ *
+ * Frames are 8N1, LSB first. Every bit edge is a simavr cycle timer, so
+ * the line is driven with cycle accuracy relative to the device clock.
+ * Frames from the device are sampled in the middle of each bit, timed
+ * from the falling edge of the start bit.
+ ************************************************************************/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_cycle_timers.h>
+#include <simavr/avr_ioport.h>
+#include "sim_uart.h"
+
+#define QUEUE_MASK		(SIM_UART_QUEUE_SIZE - 1)
+
+static avr_cycle_count_t next_bit(avr_t *avr, avr_cycle_count_t when, void *param);
+
+/************************************************************************
+ * start_frame: start sending the next queued byte, if any
+ ************************************************************************/
+
+static void start_frame(struct sim_uart *uart, avr_cycle_count_t when)
+{
+
+	if (uart->head == uart->tail) {
+		uart->busy = 0;
+		return;
+	}
+
+	uart->busy = 1;
+	uart->bit_counter = 0;
+	avr_raise_irq(uart->rx_irq, 0);		// Start bit
+	avr_cycle_timer_register(uart->avr, uart->bit, next_bit, uart);
+
+}
+
+/************************************************************************
+ * next_bit: cycle timer callback, drive the line for the next bit
+ *
+ * bit_counter 0-7 are data bits, 8 is the stop bit, 9 and up the gap
+ ************************************************************************/
+
+static avr_cycle_count_t next_bit(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+
+	struct sim_uart *uart = param;
+	uint8_t data = uart->queue[uart->tail];
+
+	if (uart->bit_counter < 8) {
+
+		avr_raise_irq(uart->rx_irq, (data >> uart->bit_counter) & 1);
+
+	} else if (uart->bit_counter == 8) {
+
+		avr_raise_irq(uart->rx_irq, 1);
+		if (uart->on_stop_bit)
+			uart->on_stop_bit(uart, data, when);
+
+	}
+
+	if (uart->bit_counter++ < 9 + uart->gap)
+		return when + uart->bit;
+
+	// Frame and gap done
+	uart->tail = (uart->tail + 1) & QUEUE_MASK;
+	start_frame(uart, when);
+
+	return 0;
+
+}
+
+extern void sim_uart_init(struct sim_uart *uart, avr_t *avr, uint32_t baud, uint8_t rx_pin)
+{
+
+	uart->avr = avr;
+	uart->baud = baud;
+	uart->bit = avr->frequency / baud;
+	uart->head = uart->tail = 0;
+	uart->busy = 0;
+	uart->rx_irq = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), rx_pin);
+
+	avr_raise_irq(uart->rx_irq, 1);		// Idle
+
+}
+
+/************************************************************************
+ * sample_bit: cycle timer callback, sample the device TX line
+ *
+ * rx_bit_counter 0-7 are data bits, 8 is the stop bit
+ ************************************************************************/
+
+static avr_cycle_count_t sample_bit(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+
+	struct sim_uart *uart = param;
+
+	if (uart->rx_bit_counter < 8) {
+		uart->rx_byte |= uart->tx_level << uart->rx_bit_counter++;
+		return when + uart->bit;
+	}
+
+	uart->receiving = 0;
+	if (uart->on_receive)
+		uart->on_receive(uart, uart->rx_byte, uart->tx_level);
+
+	return 0;
+
+}
+
+/************************************************************************
+ * on_tx_change: device TX pin changed, look for start bits
+ ************************************************************************/
+
+static void on_tx_change(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+
+	struct sim_uart *uart = param;
+
+	uart->tx_level = value & 1;
+
+	if (uart->tx_level || uart->receiving)
+		return;
+
+	uart->receiving = 1;
+	uart->rx_byte = 0;
+	uart->rx_bit_counter = 0;
+	avr_cycle_timer_register(uart->avr, uart->bit + uart->bit / 2, sample_bit, uart);
+
+}
+
+extern void sim_uart_listen(struct sim_uart *uart, uint8_t tx_pin)
+{
+
+	uart->tx_level = 1;
+	uart->receiving = 0;
+	avr_irq_register_notify(
+		avr_io_getirq(uart->avr, AVR_IOCTL_IOPORT_GETIRQ('B'), tx_pin),
+		on_tx_change, uart);
+
+}
+
+extern int sim_uart_send(struct sim_uart *uart, uint8_t data)
+{
+
+	if (((uart->head + 1) & QUEUE_MASK) == uart->tail)
+		return -1;
+
+	uart->queue[uart->head] = data;
+	uart->head = (uart->head + 1) & QUEUE_MASK;
+
+	if (!uart->busy)
+		start_frame(uart, uart->avr->cycle);
+
+	return 0;
+
+}
+
+extern uint16_t sim_uart_pending(struct sim_uart *uart)
+{
+
+	return (uart->head - uart->tail) & QUEUE_MASK;
+
+}
+
+extern avr_t *sim_load_device(const char *path, uint32_t frequency)
+{
+
+	elf_firmware_t firmware = {{0}};
+	avr_t *avr;
+
+	if (elf_read_firmware(path, &firmware)) {
+		fprintf(stderr, "cannot read %s\n", path);
+		return NULL;
+	}
+
+	if ((avr = avr_make_mcu_by_name("attiny85")) == NULL)
+		return NULL;
+
+	avr_init(avr);
+	avr->frequency = frequency;
+	avr_load_firmware(avr, &firmware);
+
+	return avr;
+
+}
+
+extern int sim_run_until(avr_t *avr, avr_cycle_count_t cycle)
+{
+
+	int state;
+
+	while (avr->cycle < cycle) {
+		state = avr_run(avr);
+		if (state == cpu_Done || state == cpu_Crashed)
+			return -1;
+	}
+
+	return 0;
+
+}
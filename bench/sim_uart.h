@@ -0,0 +1,106 @@
+/************************************************************************
+ * sim_uart
+ *
+ * Host side UART peer for libserial benchmarks under simavr
+ ************************************************************************/
+
+#include <stdint.h>
+#include <simavr/sim_avr.h>
+
+#define SIM_UART_QUEUE_SIZE			256			// In bytes, power of 2
+
+/************************************************************************
+ * struct sim_uart: one simulated peer on the device RX pin
+ *
+ * Members:
+ *		avr_t *avr				The simulated device
+ *		uint32_t baud			Line speed
+ *		avr_cycle_count_t bit	Bit time in CPU cycles
+ *		uint8_t gap				Idle bit times between frames
+ *		on_stop_bit				Called when a frame's stop bit starts, with
+ *								the byte and the cycle count. May be NULL
+ *		on_receive				Called for every frame the device sends,
+ *								once listening (see sim_uart_listen). The
+ *								stop bit flag is 0 on a framing error
+ ************************************************************************/
+
+struct sim_uart {
+	avr_t *avr;
+	uint32_t baud;
+	avr_cycle_count_t bit;
+	uint8_t gap;
+	void (*on_stop_bit)(struct sim_uart *uart, uint8_t data, avr_cycle_count_t when);
+	void (*on_receive)(struct sim_uart *uart, uint8_t data, uint8_t stop_bit);
+	void *param;
+
+	// Private
+	avr_irq_t *rx_irq;
+	uint8_t queue[SIM_UART_QUEUE_SIZE];
+	uint16_t head;
+	uint16_t tail;
+	uint8_t bit_counter;
+	uint8_t busy;
+	uint8_t tx_level;
+	uint8_t rx_byte;
+	uint8_t rx_bit_counter;
+	uint8_t receiving;
+};
+
+/************************************************************************
+ * sim_uart_init: attach a peer to a port B pin of the device
+ *
+ * Parameters:
+ *		struct sim_uart *uart	The peer
+ *		avr_t *avr				The device, initialised, with frequency set
+ *		uint32_t baud			Line speed
+ *		uint8_t rx_pin			Device RX pin number on port B
+ ************************************************************************/
+
+extern void sim_uart_init(struct sim_uart *uart, avr_t *avr, uint32_t baud, uint8_t rx_pin);
+
+/************************************************************************
+ * sim_uart_listen: decode what the device sends on a port B pin
+ *
+ * Parameters:
+ *		struct sim_uart *uart	The peer, initialised
+ *		uint8_t tx_pin			Device TX pin number on port B
+ ************************************************************************/
+
+extern void sim_uart_listen(struct sim_uart *uart, uint8_t tx_pin);
+
+/************************************************************************
+ * sim_uart_send: queue a byte for transmission to the device
+ *
+ * Returns:
+ *		0 on success, -1 if the queue is full
+ ************************************************************************/
+
+extern int sim_uart_send(struct sim_uart *uart, uint8_t data);
+
+/************************************************************************
+ * sim_uart_pending: number of bytes queued but not completely sent
+ ************************************************************************/
+
+extern uint16_t sim_uart_pending(struct sim_uart *uart);
+
+/************************************************************************
+ * sim_load_device: create a simulated ATTiny85 running a firmware image
+ *
+ * Parameters:
+ *		const char *path		ELF file to load
+ *		uint32_t frequency		CPU clock in Hz
+ *
+ * Returns:
+ *		The device, or NULL on error
+ ************************************************************************/
+
+extern avr_t *sim_load_device(const char *path, uint32_t frequency);
+
+/************************************************************************
+ * sim_run_until: run the device up to a cycle count
+ *
+ * Returns:
+ *		0 when the cycle count was reached, -1 if the device stopped
+ ************************************************************************/
+
+extern int sim_run_until(avr_t *avr, avr_cycle_count_t cycle);
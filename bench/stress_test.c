@@ -0,0 +1,201 @@
+/************************************************************************
+ * Full duplex saturation stress test
+ *
+ * Sends back to back frames to fw_stress, which echoes them, and checks
+ * what comes back. Frames are
+ *
+ *		0x7e seq payload[6] crc_high crc_low
+ *
+ * with seq and payload below 0x7e and the CRC-8 of seq and payload sent
+ * as two nibbles, so 0x7e only ever marks a frame start. Sequence gaps
+ * are lost frames, frames of the wrong length or with a bad CRC are
+ * corrupted ones. Byte counts are kept alongside.
+ *
+ * Usage: stress_test firmware.elf baud [seconds]
+ ************************************************************************/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <simavr/sim_avr.h>
+#include "sim_uart.h"
+
+#define F_CPU			8000000
+#define RX_PIN			1
+#define TX_PIN			2
+
+#define FRAME_START		0x7e
+#define PAYLOAD_SIZE	6
+#define FRAME_SIZE		(1 + 1 + PAYLOAD_SIZE + 2)
+#define SEQ_MODULO		0x7e
+
+struct stats {
+	uint32_t frames_sent;
+	uint32_t frames_good;
+	uint32_t frames_lost;
+	uint32_t frames_corrupt;
+	uint32_t bytes_sent;
+	uint32_t bytes_received;
+	uint32_t framing_errors;
+};
+
+static struct stats stats;
+
+// Echoed frame being collected
+static uint8_t frame[FRAME_SIZE];
+static uint8_t frame_length = 0;
+static int16_t expected_seq = -1;
+
+static uint8_t crc8(uint8_t *data, uint8_t length)
+{
+
+	uint8_t crc = 0;
+	uint8_t i;
+
+	while (length--) {
+		crc ^= *data++;
+		for (i = 0; i < 8; i++)
+			crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+	}
+
+	return crc;
+
+}
+
+/************************************************************************
+ * check_frame: account for a completed echoed frame
+ ************************************************************************/
+
+static void check_frame(void)
+{
+
+	uint8_t crc;
+
+	if (!frame_length)
+		return;
+
+	crc = frame[FRAME_SIZE - 2] << 4 | frame[FRAME_SIZE - 1];
+	if (frame_length != FRAME_SIZE || crc != crc8(frame + 1, 1 + PAYLOAD_SIZE)) {
+		stats.frames_corrupt++;
+		if (expected_seq >= 0)
+			expected_seq = (expected_seq + 1) % SEQ_MODULO;
+		return;
+	}
+
+	if (expected_seq >= 0)
+		stats.frames_lost += (frame[1] - expected_seq + SEQ_MODULO) % SEQ_MODULO;
+	expected_seq = (frame[1] + 1) % SEQ_MODULO;
+	stats.frames_good++;
+
+}
+
+static void on_receive(struct sim_uart *uart, uint8_t data, uint8_t stop_bit)
+{
+
+	stats.bytes_received++;
+	if (!stop_bit)
+		stats.framing_errors++;
+
+	if (data == FRAME_START) {
+		check_frame();
+		frame_length = 0;
+	}
+
+	if (frame_length < FRAME_SIZE)
+		frame[frame_length] = data;
+	if (frame_length < 255)
+		frame_length++;
+
+}
+
+/************************************************************************
+ * send_frame: queue one frame, if the peer has room for all of it
+ ************************************************************************/
+
+static int send_frame(struct sim_uart *uart)
+{
+
+	uint8_t out[FRAME_SIZE];
+	uint8_t crc;
+	uint8_t i;
+
+	if (SIM_UART_QUEUE_SIZE - 1 - sim_uart_pending(uart) < FRAME_SIZE)
+		return -1;
+
+	out[0] = FRAME_START;
+	out[1] = stats.frames_sent % SEQ_MODULO;
+	for (i = 0; i < PAYLOAD_SIZE; i++)
+		out[2 + i] = rand() % FRAME_START;
+	crc = crc8(out + 1, 1 + PAYLOAD_SIZE);
+	out[FRAME_SIZE - 2] = crc >> 4;
+	out[FRAME_SIZE - 1] = crc & 0x0f;
+
+	for (i = 0; i < FRAME_SIZE; i++)
+		sim_uart_send(uart, out[i]);
+
+	stats.frames_sent++;
+	stats.bytes_sent += FRAME_SIZE;
+
+	return 0;
+
+}
+
+int main(int argc, char *argv[])
+{
+
+	struct sim_uart uart = {0};
+	avr_cycle_count_t end;
+	avr_t *avr;
+	uint32_t baud;
+	double seconds = 2;
+	double line_rate;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s firmware.elf baud [seconds]\n", argv[0]);
+		return 2;
+	}
+	baud = atol(argv[2]);
+	if (argc > 3)
+		seconds = atof(argv[3]);
+
+	if ((avr = sim_load_device(argv[1], F_CPU)) == NULL)
+		return 2;
+
+	sim_uart_init(&uart, avr, baud, RX_PIN);
+	sim_uart_listen(&uart, TX_PIN);
+	uart.on_receive = on_receive;
+
+	if (sim_run_until(avr, F_CPU / 1000))
+		return 2;
+
+	srand(1);
+	end = avr->cycle + seconds * F_CPU;
+	while (avr->cycle < end) {
+		while (send_frame(&uart) == 0);
+		if (sim_run_until(avr, avr->cycle + FRAME_SIZE * 10 * uart.bit))
+			return 2;
+	}
+
+	// Stop sending and let the echo drain
+	while (sim_uart_pending(&uart) || uart.busy)
+		if (sim_run_until(avr, avr->cycle + 10 * uart.bit))
+			return 2;
+	if (sim_run_until(avr, avr->cycle + 256 * 10 * uart.bit))
+		return 2;
+	check_frame();
+
+	// Lost frames include those missing after the last good one, which
+	// no sequence gap shows
+	line_rate = baud / 10.0;
+	printf("%6u baud: sent %6u frames, good %6u, lost %5u (%u in gaps), corrupt %5u, "
+		"bytes lost %6d, framing errors %4u, throughput %5.1f%% of line rate\n",
+		baud, stats.frames_sent, stats.frames_good,
+		stats.frames_sent - stats.frames_good - stats.frames_corrupt,
+		stats.frames_lost, stats.frames_corrupt,
+		(int)(stats.bytes_sent - stats.bytes_received),
+		stats.framing_errors,
+		100.0 * stats.frames_good * FRAME_SIZE / (seconds * line_rate));
+
+	return 0;
+
+}
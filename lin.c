@@ -0,0 +1,278 @@
+/************************************************************************
+ * libserial LIN slave
+ *
+ * The library takes care of the header: break, sync (the timer follows
+ * the master's speed) and PID. Here the PID is checked and the response
+ * is sent or received, with the checksum kept up to date byte by byte.
+ ************************************************************************/
+
+#include <avr/io.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "serial.h"
+#include "lin.h"
+
+#ifndef SERIAL_LIN
+#error "lin.c needs libserial built with -DSERIAL_LIN"
+#endif
+
+#ifdef RX_ONLY
+#error "lin.c needs the TX path to publish"
+#endif
+
+// Response states
+#define RESPONSE_IDLE		0		// Not ours, bytes are dropped
+#define RESPONSE_RECEIVING	1		// Subscribed frame coming in
+#define RESPONSE_SENDING	2		// Reading back our own bytes
+
+#define DIAGNOSTIC_ID		60		// 60 and 61, always classic checksum
+
+
+/************************************************************************
+ * File global variables
+ ************************************************************************/
+
+static struct lin_init lin_config;
+
+static struct lin_frame *response_frame = NULL;
+static uint8_t response_state = RESPONSE_IDLE;
+static uint8_t response_data[LIN_MAX_DATA + 1];	// Plus checksum
+static uint8_t response_index = 0;
+static uint16_t response_sum = 0;
+
+// Header waiting for the bytes before it to be read
+static uint8_t header_pending = 0;
+static uint8_t header_pid = 0;
+static uint8_t header_mark = 0;
+static uint8_t bytes_read = 0;		// Modulo 256, as the library's mark
+
+static uint16_t lin_errors = 0;
+
+
+/************************************************************************
+ * Private functions
+ ************************************************************************/
+
+/************************************************************************
+ * protect_id: add the parity bits to a frame identifier
+ *
+ * P0 = ID0 ^ ID1 ^ ID2 ^ ID4, P1 = !(ID1 ^ ID3 ^ ID4 ^ ID5)
+ ************************************************************************/
+
+static uint8_t protect_id(uint8_t id)
+{
+
+	uint8_t p0 = (id ^ id >> 1 ^ id >> 2 ^ id >> 4) & 1;
+	uint8_t p1 = ~(id >> 1 ^ id >> 3 ^ id >> 4 ^ id >> 5) & 1;
+
+	return id | p0 << 6 | p1 << 7;
+
+}
+
+/************************************************************************
+ * checksum_add: add a byte to the checksum
+ *
+ * Sum with the carry added back in; the checksum is its inverse
+ ************************************************************************/
+
+static uint16_t checksum_add(uint16_t sum, uint8_t data)
+{
+
+	sum += data;
+	if (sum > 0xff)
+		sum -= 0xff;
+
+	return sum;
+
+}
+
+/************************************************************************
+ * start_response: act on a header
+ *
+ * Parameters:
+ *		uint8_t pid		Protected identifier as received
+ ************************************************************************/
+
+static void start_response(uint8_t pid)
+{
+
+	uint8_t id = pid & 0x3f;
+	uint8_t i;
+
+	response_state = RESPONSE_IDLE;
+	response_frame = NULL;
+
+	if (protect_id(id) != pid) {
+		lin_errors++;
+		return;
+	}
+
+	for (i = 0; i < lin_config.frame_count; i++)
+		if (lin_config.frames[i].id == id)
+			response_frame = &lin_config.frames[i];
+	if (response_frame == NULL)
+		return;
+
+	response_index = 0;
+	response_sum = 0;
+	if (lin_config.checksum == LIN_CHECKSUM_ENHANCED && id < DIAGNOSTIC_ID)
+		response_sum = pid;
+
+	if (response_frame->direction == LIN_SUBSCRIBE) {
+		response_state = RESPONSE_RECEIVING;
+		return;
+	}
+
+	// Publish: queue data and checksum in one go, the master is timing
+	// the response space
+	for (i = 0; i < response_frame->length; i++) {
+		response_data[i] = response_frame->data[i];
+		response_sum = checksum_add(response_sum, response_data[i]);
+	}
+	response_data[i] = ~response_sum & 0xff;
+
+	for (i = 0; i <= response_frame->length; i++)
+		serial_put_char(response_data[i]);
+
+#ifdef SERIAL_ECHO
+	// The library checks and drops the echo itself
+	response_state = RESPONSE_IDLE;
+#else
+	response_state = RESPONSE_SENDING;
+#endif
+
+}
+
+/************************************************************************
+ * receive_byte: handle a response byte
+ *
+ * Returns: frame id if this completed one, LIN_NONE otherwise
+ ************************************************************************/
+
+static uint8_t receive_byte(uint8_t data)
+{
+
+	switch (response_state) {
+
+		case RESPONSE_RECEIVING:
+
+			if (response_index < response_frame->length) {
+				response_data[response_index++] = data;
+				response_sum = checksum_add(response_sum, data);
+				return LIN_NONE;
+			}
+
+			response_state = RESPONSE_IDLE;
+			if ((~response_sum & 0xff) != data) {
+				lin_errors++;
+				return LIN_NONE;
+			}
+			memcpy(response_frame->data, response_data, response_frame->length);
+
+			return response_frame->id;
+
+		case RESPONSE_SENDING:
+
+			// Single wire bus: our own bytes come back
+			if (data != response_data[response_index])
+				lin_errors++;
+			if (response_index++ < response_frame->length)
+				return LIN_NONE;
+
+			response_state = RESPONSE_IDLE;
+
+			return response_frame->id;
+
+	}
+
+	return LIN_NONE;
+
+}
+
+
+/************************************************************************
+ * Public functions
+ ************************************************************************/
+
+/************************************************************************
+ * lin_initialise: set up the link and the slave
+ *
+ * Parameters:
+ *		struct serial_init *serial_init	Passed on to serial_initialise
+ *		struct lin_init *lin_init		Frame table
+ *
+ * Returns:
+ *		SERIAL_ERROR if serial_initialise fails
+ *		SERIAL_OK otherwise
+ ************************************************************************/
+
+extern return_code_t lin_initialise(struct serial_init *serial_init,
+	struct lin_init *lin_init)
+{
+
+	if (serial_initialise(serial_init) != SERIAL_OK)
+		return SERIAL_ERROR;
+
+	lin_config = *lin_init;
+	response_state = RESPONSE_IDLE;
+	header_pending = 0;
+	bytes_read = 0;
+	lin_errors = 0;
+
+	serial_enable_receive();
+
+	return SERIAL_OK;
+
+}
+
+/************************************************************************
+ * lin_poll: handle headers and responses
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		uint8_t id	Identifier of a frame that completed, or LIN_NONE
+ *
+ * Bytes are read one by one, counting them, so that a header only takes
+ * effect once the bytes that came in before it have been dealt with.
+ ************************************************************************/
+
+extern uint8_t lin_poll()
+{
+
+	uint8_t id;
+
+	while (1) {
+
+		if (!header_pending &&
+			serial_lin_get_header(&header_pid, &header_mark) == SERIAL_OK)
+			header_pending = 1;
+
+		if (header_pending && bytes_read == header_mark) {
+			header_pending = 0;
+			start_response(header_pid);
+			continue;
+		}
+
+		if (!serial_data_pending())
+			return LIN_NONE;
+
+		bytes_read++;
+		if ((id = receive_byte(serial_get_char())) != LIN_NONE)
+			return id;
+
+	}
+
+}
+
+/************************************************************************
+ * lin_get_errors: count of bad headers and responses
+ ************************************************************************/
+
+extern uint16_t lin_get_errors()
+{
+
+	return lin_errors;
+
+}
@@ -0,0 +1,101 @@
+/************************************************************************
+ * libserial LIN slave
+ *
+ * Answers and listens to LIN frames over libserial. Needs the library
+ * built with -DSERIAL_LIN, which detects the break and synchronises to
+ * the master on the sync byte. Include serial.h before this file.
+ ************************************************************************/
+
+#define LIN_MAX_DATA				8			// Bytes per frame
+
+#define LIN_PUBLISH					0			// We send the response
+#define LIN_SUBSCRIBE				1			// Someone else does
+
+#define LIN_CHECKSUM_CLASSIC		0			// LIN 1.x: data only
+#define LIN_CHECKSUM_ENHANCED		1			// LIN 2.x: PID and data
+
+#define LIN_NONE					0xff		// No frame, from lin_poll
+
+/************************************************************************
+ * struct lin_frame: a frame this slave takes part in
+ *
+ * Members:
+ *		uint8_t id			Frame identifier, 0 to 63, without parity
+ *		uint8_t direction	LIN_PUBLISH or LIN_SUBSCRIBE
+ *		uint8_t length		Data bytes, 1 to LIN_MAX_DATA
+ *		uint8_t *data		Response data: sent from here when
+ *							publishing, copied here when subscribed and
+ *							the checksum is good
+ ************************************************************************/
+
+struct lin_frame {
+	uint8_t id;
+	uint8_t direction;
+	uint8_t length;
+	uint8_t *data;
+};
+
+/************************************************************************
+ * struct lin_init: slave setup
+ *
+ * Members:
+ *		struct lin_frame *frames	Frame table
+ *		uint8_t frame_count			Entries in the table
+ *		uint8_t checksum			LIN_CHECKSUM_CLASSIC or _ENHANCED.
+ *									Diagnostic frames 60 and 61 always
+ *									use the classic checksum.
+ ************************************************************************/
+
+struct lin_init {
+	struct lin_frame *frames;
+	uint8_t frame_count;
+	uint8_t checksum;
+};
+
+/************************************************************************
+ * lin_initialise: set up the link and the slave
+ *
+ * Parameters:
+ *		struct serial_init *serial_init	Passed on to serial_initialise,
+ *										with the nominal bus speed
+ *		struct lin_init *lin_init		Frame table, copied
+ *
+ * Returns:
+ *		SERIAL_ERROR if serial_initialise fails
+ *		SERIAL_OK otherwise
+ *
+ * Starts receiving. Interrupts have to be enabled by the caller.
+ ************************************************************************/
+
+extern return_code_t lin_initialise(struct serial_init *serial_init,
+	struct lin_init *lin_init);
+
+/************************************************************************
+ * lin_poll: handle headers and responses
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		uint8_t id	Identifier of a frame that completed: published, or
+ *					received with a good checksum and copied to its data.
+ *					LIN_NONE if none did.
+ *
+ * Call from the main loop. A published response is queued as soon as
+ * lin_poll sees its header, so call it at least once a byte time to keep
+ * within the response space.
+ ************************************************************************/
+
+extern uint8_t lin_poll();
+
+/************************************************************************
+ * lin_get_errors: count of bad headers and responses
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		uint16_t errors	PID parity errors, bad checksums on subscribed
+ *						frames and published bytes that did not read
+ *						back as sent, since initialisation. Wraps around.
+ ************************************************************************/
+
+extern uint16_t lin_get_errors();
@@ -0,0 +1,447 @@
+/************************************************************************
+ * libserial Modbus RTU slave
+ *
+ * Frames are delimited by silence on the line: more than 1.5 character
+ * times inside a frame breaks it, 3.5 character times ends it. Both are
+ * measured in Timer1 ticks from the RX timestamps, so there is no extra
+ * timer or interrupt.
+ ************************************************************************/
+
+#include <avr/io.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <util/crc16.h>
+#include "serial.h"
+#include "modbus.h"
+
+#ifndef RX_TIMESTAMPS
+#error "modbus.c needs libserial built with -DRX_TIMESTAMPS"
+#endif
+
+#if defined(TX_ONLY) || defined(RX_ONLY)
+#error "modbus.c needs both RX and TX"
+#endif
+
+#define CHAR_BITS			10		// 8N1
+
+// Frame states
+#define FRAME_IDLE			0		// Waiting for an address byte
+#define FRAME_RECEIVING		1		// Addressed to us, buffering
+#define FRAME_SKIPPING		2		// Not for us or broken, waiting for t3.5
+
+// Exception codes
+#define EXCEPTION_FUNCTION	0x01
+#define EXCEPTION_ADDRESS	0x02
+#define EXCEPTION_VALUE		0x03
+
+
+/************************************************************************
+ * File global variables
+ ************************************************************************/
+
+static struct modbus_init modbus_config;
+
+static uint8_t frame[MODBUS_FRAME_SIZE];
+static uint8_t frame_length = 0;
+static uint8_t frame_state = FRAME_IDLE;
+static uint16_t frame_crc = 0xffff;
+static uint16_t last_timestamp = 0;		// Of the last byte received
+
+// Silence limits in ticks, for the timing they were worked out from
+static uint32_t tick_rate = 0;
+static uint8_t bit_ticks = 0;
+static uint16_t char_ticks = 20;
+static uint16_t t15_ticks = 30;
+static uint16_t t35_ticks = 70;
+
+
+/************************************************************************
+ * Private functions
+ ************************************************************************/
+
+static uint16_t get_word(uint8_t *data)
+{
+
+	return (uint16_t)data[0] << 8 | data[1];
+
+}
+
+static void put_word(uint8_t *data, uint16_t word)
+{
+
+	data[0] = word >> 8;
+	data[1] = word & 0xff;
+
+}
+
+/************************************************************************
+ * exception: turn the frame into an exception reply
+ *
+ * Returns: length of the reply, without CRC
+ ************************************************************************/
+
+static uint8_t exception(uint8_t code)
+{
+
+	frame[1] |= 0x80;
+	frame[2] = code;
+
+	return 3;
+
+}
+
+static uint8_t get_coil(uint16_t coil)
+{
+
+	return (modbus_config.coils[coil >> 3] >> (coil & 7)) & 1;
+
+}
+
+static void set_coil(uint16_t coil, uint8_t value)
+{
+
+	if (value)
+		modbus_config.coils[coil >> 3] |= (1 << (coil & 7));
+	else
+		modbus_config.coils[coil >> 3] &= ~(1 << (coil & 7));
+
+}
+
+/************************************************************************
+ * handle_request: carry out a request
+ *
+ * Parameters:
+ *		uint8_t length	Length of the request in frame, without CRC
+ *
+ * Returns:
+ *		Length of the reply written over the request, without CRC
+ *
+ * Replies, including exceptions, have to fit in MODBUS_FRAME_SIZE, which
+ * limits the quantities that can be read in one go.
+ ************************************************************************/
+
+static uint8_t handle_request(uint8_t length)
+{
+
+	uint16_t start = get_word(frame + 2);
+	uint16_t quantity = get_word(frame + 4);
+	uint16_t i;
+
+	switch (frame[1]) {
+
+		case MODBUS_READ_COILS:
+
+			if (length != 6)
+				return exception(EXCEPTION_VALUE);
+			if (quantity == 0 || quantity > (MODBUS_FRAME_SIZE - 5) * 8)
+				return exception(EXCEPTION_VALUE);
+			if ((uint32_t)start + quantity > modbus_config.coil_count)
+				return exception(EXCEPTION_ADDRESS);
+
+			frame[2] = (quantity + 7) / 8;
+			memset(frame + 3, 0, frame[2]);
+			for (i = 0; i < quantity; i++)
+				frame[3 + i / 8] |= get_coil(start + i) << (i & 7);
+
+			return 3 + frame[2];
+
+		case MODBUS_READ_REGISTERS:
+
+			if (length != 6)
+				return exception(EXCEPTION_VALUE);
+			if (quantity == 0 || quantity > (MODBUS_FRAME_SIZE - 5) / 2)
+				return exception(EXCEPTION_VALUE);
+			if ((uint32_t)start + quantity > modbus_config.register_count)
+				return exception(EXCEPTION_ADDRESS);
+
+			frame[2] = quantity * 2;
+			for (i = 0; i < quantity; i++)
+				put_word(frame + 3 + 2 * i, modbus_config.registers[start + i]);
+
+			return 3 + frame[2];
+
+		case MODBUS_WRITE_COIL:
+
+			// quantity is the value here: 0xff00 on, 0x0000 off
+			if (length != 6 || (quantity != 0xff00 && quantity != 0))
+				return exception(EXCEPTION_VALUE);
+			if (start >= modbus_config.coil_count)
+				return exception(EXCEPTION_ADDRESS);
+
+			set_coil(start, quantity != 0);
+
+			return 6;	// Echo of the request
+
+		case MODBUS_WRITE_REGISTER:
+
+			if (length != 6)
+				return exception(EXCEPTION_VALUE);
+			if (start >= modbus_config.register_count)
+				return exception(EXCEPTION_ADDRESS);
+
+			modbus_config.registers[start] = quantity;
+
+			return 6;
+
+		case MODBUS_WRITE_COILS:
+
+			if (quantity == 0 || frame[6] != (quantity + 7) / 8 ||
+				length != 7 + frame[6])
+				return exception(EXCEPTION_VALUE);
+			if ((uint32_t)start + quantity > modbus_config.coil_count)
+				return exception(EXCEPTION_ADDRESS);
+
+			for (i = 0; i < quantity; i++)
+				set_coil(start + i, (frame[7 + i / 8] >> (i & 7)) & 1);
+
+			return 6;	// Address, function, start and quantity
+
+		case MODBUS_WRITE_REGISTERS:
+
+			if (quantity == 0 || frame[6] != quantity * 2 ||
+				length != 7 + frame[6])
+				return exception(EXCEPTION_VALUE);
+			if ((uint32_t)start + quantity > modbus_config.register_count)
+				return exception(EXCEPTION_ADDRESS);
+
+			for (i = 0; i < quantity; i++)
+				modbus_config.registers[start + i] = get_word(frame + 7 + 2 * i);
+
+			return 6;
+
+		default:
+
+			return exception(EXCEPTION_FUNCTION);
+
+	}
+
+}
+
+/************************************************************************
+ * send_reply: append the CRC to the reply in frame and queue it
+ *
+ * The master waits for the reply before sending, so the TX buffer is
+ * normally empty; if not, wait for room.
+ ************************************************************************/
+
+static void send_reply(uint8_t length)
+{
+
+	uint16_t crc = 0xffff;
+	uint8_t i;
+
+	for (i = 0; i < length; i++)
+		crc = _crc16_update(crc, frame[i]);
+
+	// CRC goes low byte first, unlike the data
+	frame[length++] = crc & 0xff;
+	frame[length++] = crc >> 8;
+
+	for (i = 0; i < length; i++)
+		while (serial_put_char(frame[i]) != SERIAL_OK);
+
+}
+
+/************************************************************************
+ * end_frame: handle a frame after 3.5 character times of silence
+ *
+ * Returns: function code served, or 0
+ ************************************************************************/
+
+static uint8_t end_frame(void)
+{
+
+	uint8_t function = 0;
+	uint8_t length;
+
+	// Running the CRC over the CRC bytes too leaves 0 for a good frame
+	if (frame_state == FRAME_RECEIVING && frame_length >= 4 && frame_crc == 0) {
+
+		function = frame[1];
+		length = handle_request(frame_length - 2);
+
+		// No reply to broadcasts, not even exceptions
+		if (frame[0] != MODBUS_BROADCAST)
+			send_reply(length);
+		if (frame[1] & 0x80)
+			function = 0;
+
+	}
+
+	frame_state = FRAME_IDLE;
+	frame_length = 0;
+	frame_crc = 0xffff;
+
+	return function;
+
+}
+
+/************************************************************************
+ * update_timing: work out the silence limits from the link's timing
+ *
+ * Only does the sums when the library's tick rate or received bit
+ * length has changed since the last call, e.g. after serial_set_baud or
+ * serial_set_speeds. The limits are 1.5 and 3.5 characters up to 19200
+ * baud, and a fixed 750 us and 1750 us above that, as the Modbus spec
+ * asks.
+ ************************************************************************/
+
+static void update_timing(void)
+{
+
+	uint32_t rate = serial_get_tick_rate();
+	uint8_t ticks = serial_get_rx_bit_ticks();
+
+	if (rate == tick_rate && ticks == bit_ticks)
+		return;
+
+	tick_rate = rate;
+	bit_ticks = ticks;
+	char_ticks = CHAR_BITS * ticks;
+
+	// The receive speed is rate / ticks baud
+	if (rate / ticks > 19200) {
+		t15_ticks = rate * 750 / 1000000;
+		t35_ticks = rate * 1750 / 1000000;
+	} else {
+		t15_ticks = 3 * char_ticks / 2;
+		t35_ticks = 7 * char_ticks / 2;
+	}
+
+}
+
+/************************************************************************
+ * receive_byte: add a byte to the frame
+ *
+ * Parameters:
+ *		uint8_t data		The byte
+ *		uint16_t timestamp	Tick of its stop bit
+ *
+ * Returns: function code served if the byte showed the previous frame
+ * had ended, or 0
+ ************************************************************************/
+
+static uint8_t receive_byte(uint8_t data, uint16_t timestamp)
+{
+
+	uint8_t function = 0;
+	uint16_t delta = timestamp - last_timestamp;
+	uint16_t silence = 0;
+
+	// Stop bits of back to back bytes can be a tick less than a
+	// character apart, as the start bit is only seen to within a tick
+	if (delta > char_ticks)
+		silence = delta - char_ticks;
+
+	// A frame that was not polled out in time ends here
+	if (frame_state != FRAME_IDLE && silence >= t35_ticks)
+		function = end_frame();
+	else if (frame_state == FRAME_RECEIVING && silence > t15_ticks)
+		frame_state = FRAME_SKIPPING;	// Gap in the frame
+
+	last_timestamp = timestamp;
+
+	if (frame_state == FRAME_IDLE) {
+		if (data == modbus_config.address || data == MODBUS_BROADCAST)
+			frame_state = FRAME_RECEIVING;
+		else
+			frame_state = FRAME_SKIPPING;
+	}
+
+	if (frame_state != FRAME_RECEIVING)
+		return function;
+
+	if (frame_length == MODBUS_FRAME_SIZE) {
+		frame_state = FRAME_SKIPPING;
+		return function;
+	}
+
+	frame[frame_length++] = data;
+	frame_crc = _crc16_update(frame_crc, data);
+
+	return function;
+
+}
+
+
+/************************************************************************
+ * Public functions
+ ************************************************************************/
+
+/************************************************************************
+ * modbus_initialise: set up the link and the slave
+ *
+ * Parameters:
+ *		struct serial_init *serial_init	Passed on to serial_initialise
+ *		struct modbus_init *modbus_init	Address and tables
+ *
+ * Returns:
+ *		SERIAL_ERROR if the address is invalid or serial_initialise fails
+ *		SERIAL_OK otherwise
+ *
+ * The silence limits follow the link's speed, see update_timing, and
+ * keep up with later speed changes on the next modbus_poll.
+ ************************************************************************/
+
+extern return_code_t modbus_initialise(struct serial_init *serial_init,
+	struct modbus_init *modbus_init)
+{
+
+	if (modbus_init->address == MODBUS_BROADCAST || modbus_init->address > 247)
+		return SERIAL_ERROR;
+
+	if (serial_initialise(serial_init) != SERIAL_OK)
+		return SERIAL_ERROR;
+
+	modbus_config = *modbus_init;
+
+	tick_rate = 0;
+	update_timing();
+
+	frame_state = FRAME_IDLE;
+	frame_length = 0;
+	frame_crc = 0xffff;
+
+	serial_enable_receive();
+
+	return SERIAL_OK;
+
+}
+
+/************************************************************************
+ * modbus_poll: handle received data
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		uint8_t function	Function code of the request served, or 0
+ *
+ * Takes the bytes out of the RX buffer one by one with their
+ * timestamps, so the CRC is up to date when the frame ends and only
+ * frames for this slave are kept.
+ ************************************************************************/
+
+extern uint8_t modbus_poll()
+{
+
+	uint8_t function = 0;
+	uint16_t timestamp;
+	uint8_t data;
+
+	update_timing();
+
+	while (serial_peek_timestamp(0, &timestamp) == SERIAL_OK) {
+		data = serial_get_char();
+		if ((function = receive_byte(data, timestamp)) != 0)
+			return function;
+	}
+
+	// The stop bit of the last byte ends a tick after its timestamp
+	if (frame_state != FRAME_IDLE &&
+		(uint16_t)(serial_get_ticks() - last_timestamp) > t35_ticks)
+		function = end_frame();
+
+	return function;
+
+}
@@ -0,0 +1,78 @@
+/************************************************************************
+ * libserial Modbus RTU slave
+ *
+ * Serves coils and holding registers over libserial. Needs the library
+ * built with -DRX_TIMESTAMPS (frame timing) and both RX and TX. Include
+ * serial.h before this file.
+ ************************************************************************/
+
+#ifndef MODBUS_FRAME_SIZE
+#define MODBUS_FRAME_SIZE			32			// In bytes, largest request or reply
+#endif
+
+#define MODBUS_BROADCAST			0
+
+// Function codes served
+#define MODBUS_READ_COILS			0x01
+#define MODBUS_READ_REGISTERS		0x03
+#define MODBUS_WRITE_COIL			0x05
+#define MODBUS_WRITE_REGISTER		0x06
+#define MODBUS_WRITE_COILS			0x0f
+#define MODBUS_WRITE_REGISTERS		0x10
+
+/************************************************************************
+ * struct modbus_init: slave setup
+ *
+ * Members:
+ *		uint8_t address			Slave address, 1 to 247
+ *		uint8_t *coils			Coil table, 8 coils per byte, coil 0 in
+ *								bit 0 of the first byte
+ *		uint16_t coil_count		Number of coils
+ *		uint16_t *registers		Holding register table
+ *		uint16_t register_count	Number of registers
+ *
+ * The tables belong to the application, which can read and update them
+ * between calls to modbus_poll.
+ ************************************************************************/
+
+struct modbus_init {
+	uint8_t address;
+	uint8_t *coils;
+	uint16_t coil_count;
+	uint16_t *registers;
+	uint16_t register_count;
+};
+
+/************************************************************************
+ * modbus_initialise: set up the link and the slave
+ *
+ * Parameters:
+ *		struct serial_init *serial_init	Passed on to serial_initialise
+ *		struct modbus_init *modbus_init	Address and tables, copied
+ *
+ * Returns:
+ *		SERIAL_ERROR if the address is invalid or serial_initialise fails
+ *		SERIAL_OK otherwise
+ *
+ * Starts receiving. Interrupts have to be enabled by the caller.
+ ************************************************************************/
+
+extern return_code_t modbus_initialise(struct serial_init *serial_init,
+	struct modbus_init *modbus_init);
+
+/************************************************************************
+ * modbus_poll: handle received data
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		uint8_t function	Function code of the request served, so the
+ *							application can act on writes, or 0 if no
+ *							request was completed or it was refused
+ *
+ * Call from the main loop, at least every 3.5 character times to keep
+ * the reply latency down. Frames for other slaves are skipped without
+ * being buffered, as soon as their address byte is in.
+ ************************************************************************/
+
+extern uint8_t modbus_poll();
@@ -0,0 +1,419 @@
+/************************************************************************
+ * libserial channel multiplexer
+ *
+ * Received frames are copied from the receive buffer to their channel's
+ * queue as soon as they are complete, so one slow reader does not hold
+ * up the others. Sending is a strict priority scheduler, taking turns
+ * within a priority, that only feeds the TX buffer a frame at a time.
+ *
+ * Frames start with MUX_SYNC and end with a CRC-8 (polynomial 0x07, as
+ * the stress benchmark uses) over channel, length and data. Data is not
+ * escaped, so MUX_SYNC can turn up inside a frame too: after a lost or
+ * corrupted byte, the receiver tries each MUX_SYNC in turn and the CRC
+ * tells the real frame starts from the false ones.
+ ************************************************************************/
+
+#include <avr/io.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <util/crc16.h>
+#include "serial.h"
+#include "mux.h"
+
+#if defined(TX_ONLY) || defined(RX_ONLY)
+#error "mux.c needs both RX and TX"
+#endif
+
+#if MUX_CHANNELS > 8
+#error "mux_poll reports channels in a byte: at most 8"
+#endif
+
+#define HEADER_SIZE			3		// Sync, channel and length
+#define FRAME_OVERHEAD		(HEADER_SIZE + 1)	// And the CRC
+
+#if FRAME_OVERHEAD + MUX_FRAME_SIZE > RX_BUFFER_SIZE || \
+	FRAME_OVERHEAD + MUX_FRAME_SIZE > TX_BUFFER_SIZE
+#error "MUX_FRAME_SIZE has to fit the RX and TX buffers"
+#endif
+
+#if MUX_FRAME_SIZE > 0xfe
+#error "MUX_FRAME_SIZE is at most 254"
+#endif
+
+struct queue {
+	uint8_t *data;
+	uint8_t size;
+	uint8_t head;		// Oldest byte
+	uint8_t count;
+};
+
+
+/************************************************************************
+ * File global variables
+ ************************************************************************/
+
+static struct queue rx_queues[MUX_CHANNELS];
+static struct queue tx_queues[MUX_CHANNELS];
+static uint8_t priorities[MUX_CHANNELS];
+static uint16_t dropped[MUX_CHANNELS];
+static uint8_t channel_count = 0;
+
+static uint16_t turn = 0;					// Frames sent, wraps
+static uint16_t last_turn[MUX_CHANNELS];	// turn at each channel's last frame
+static uint16_t mux_errors = 0;
+
+
+/************************************************************************
+ * Private functions
+ ************************************************************************/
+
+static void queue_put(struct queue *queue, uint8_t data)
+{
+
+	uint16_t index = queue->head + queue->count++;
+
+	if (index >= queue->size)
+		index -= queue->size;
+	queue->data[index] = data;
+
+}
+
+static uint8_t queue_get(struct queue *queue)
+{
+
+	uint8_t data = queue->data[queue->head];
+
+	if (++(queue->head) == queue->size)
+		queue->head = 0;
+	queue->count--;
+
+	return data;
+
+}
+
+/************************************************************************
+ * frame_crc: CRC-8 of a frame's channel, length and data
+ *
+ * Parameters:
+ *		uint8_t *frame	The frame, from its MUX_SYNC
+ *		uint8_t length	Bytes of data
+ ************************************************************************/
+
+static uint8_t frame_crc(uint8_t *frame, uint8_t length)
+{
+
+	uint8_t crc = 0;
+	uint8_t i;
+
+	for (i = 1; i < HEADER_SIZE + length; i++)
+		crc = _crc8_ccitt_update(crc, frame[i]);
+
+	return crc;
+
+}
+
+/************************************************************************
+ * receive_frames: move complete frames to the receive queues
+ *
+ * Returns: bit per channel that received data
+ *
+ * Bytes before a MUX_SYNC, and a MUX_SYNC that does not start a valid
+ * frame, are dropped and counted in mux_errors.
+ ************************************************************************/
+
+static uint8_t receive_frames(void)
+{
+
+	struct queue *queue;
+	uint8_t *frame;
+	uint8_t sync, channel, length, i;
+	int16_t next;
+	uint8_t received = 0;
+
+	while (serial_peek_char(0, &sync) == SERIAL_OK) {
+
+		// Not at a frame start: skip to the next MUX_SYNC, or everything
+		if (sync != MUX_SYNC) {
+			if ((next = serial_find_char(MUX_SYNC)) < 0)
+				next = serial_data_pending();
+			mux_errors += serial_drop_data(next);
+			continue;
+		}
+
+		if (serial_peek_char(1, &channel) != SERIAL_OK ||
+			serial_peek_char(2, &length) != SERIAL_OK)
+			break;
+
+		// Not a header: look for the next MUX_SYNC
+		if (channel >= channel_count || length == 0 || length > MUX_FRAME_SIZE) {
+			serial_drop_data(1);
+			mux_errors++;
+			continue;
+		}
+
+		if ((frame = serial_peek_data(FRAME_OVERHEAD + length)) == NULL)
+			break;
+
+		// A corrupted frame, or a MUX_SYNC in some frame's data
+		if (frame[HEADER_SIZE + length] != frame_crc(frame, length)) {
+			serial_drop_data(1);
+			mux_errors++;
+			continue;
+		}
+
+		queue = &rx_queues[channel];
+		if (queue->size - queue->count < length) {
+			dropped[channel]++;
+		} else {
+			for (i = 0; i < length; i++)
+				queue_put(queue, frame[HEADER_SIZE + i]);
+			received |= 1 << channel;
+		}
+
+		serial_drop_data(FRAME_OVERHEAD + length);
+
+	}
+
+	return received;
+
+}
+
+/************************************************************************
+ * next_channel: pick the channel to send a frame from
+ *
+ * Returns: the highest priority channel with a frame queued, the one
+ * that has waited longest among equals, or MUX_NONE
+ *
+ * Waiting is counted in frames since the channel's last one, so frames
+ * from higher priorities in between do not upset the turns.
+ ************************************************************************/
+
+static uint8_t next_channel(void)
+{
+
+	uint8_t best = MUX_NONE;
+	uint8_t channel;
+
+	for (channel = 0; channel < channel_count; channel++) {
+
+		if (!tx_queues[channel].count)
+			continue;
+		if (best == MUX_NONE || priorities[channel] > priorities[best] ||
+			(priorities[channel] == priorities[best] &&
+			(uint16_t)(turn - last_turn[channel]) >
+			(uint16_t)(turn - last_turn[best])))
+			best = channel;
+
+	}
+
+	return best;
+
+}
+
+/************************************************************************
+ * send_frames: hand queued frames to the link
+ *
+ * Stops once a frame's worth is waiting in the TX buffer. Whatever is
+ * in there has to go out before anything queued later, so keeping it
+ * short is what lets priorities work.
+ ************************************************************************/
+
+static void send_frames(void)
+{
+
+	struct queue *queue;
+	uint8_t *out;
+	uint16_t room;
+	uint8_t channel, length, i;
+
+	while ((channel = next_channel()) != MUX_NONE) {
+
+		queue = &tx_queues[channel];
+		length = queue->data[queue->head];
+
+		out = serial_reserve_data(&room);
+		if (TX_BUFFER_SIZE - room >= FRAME_OVERHEAD + MUX_FRAME_SIZE ||
+			room < FRAME_OVERHEAD + length) {
+			serial_commit_data(0);
+			return;
+		}
+
+		out[0] = MUX_SYNC;
+		out[1] = channel;
+		out[2] = queue_get(queue);
+		for (i = 0; i < length; i++)
+			out[HEADER_SIZE + i] = queue_get(queue);
+		out[HEADER_SIZE + length] = frame_crc(out, length);
+
+		serial_commit_data(FRAME_OVERHEAD + length);
+		last_turn[channel] = ++turn;
+
+	}
+
+}
+
+
+/************************************************************************
+ * Public functions
+ ************************************************************************/
+
+/************************************************************************
+ * mux_initialise: set up the link and the channels
+ *
+ * Parameters:
+ *		struct serial_init *serial_init	Passed on to serial_initialise
+ *		struct mux_init *mux_init		Channel table
+ *
+ * Returns:
+ *		SERIAL_ERROR if the channel count is invalid or serial_initialise
+ *		fails
+ *		SERIAL_OK otherwise
+ ************************************************************************/
+
+extern return_code_t mux_initialise(struct serial_init *serial_init,
+	struct mux_init *mux_init)
+{
+
+	struct mux_channel *channel;
+	uint8_t i;
+
+	if (mux_init->channel_count == 0 || mux_init->channel_count > MUX_CHANNELS)
+		return SERIAL_ERROR;
+
+	if (serial_initialise(serial_init) != SERIAL_OK)
+		return SERIAL_ERROR;
+
+	channel_count = mux_init->channel_count;
+	for (i = 0; i < channel_count; i++) {
+
+		channel = &mux_init->channels[i];
+		rx_queues[i].data = channel->rx_data;
+		rx_queues[i].size = channel->rx_size;
+		rx_queues[i].head = rx_queues[i].count = 0;
+		tx_queues[i].data = channel->tx_data;
+		tx_queues[i].size = channel->tx_size;
+		tx_queues[i].head = tx_queues[i].count = 0;
+		priorities[i] = channel->priority;
+		last_turn[i] = 0;
+		dropped[i] = 0;
+
+	}
+
+	turn = 0;
+	mux_errors = 0;
+
+	serial_enable_receive();
+
+	return SERIAL_OK;
+
+}
+
+/************************************************************************
+ * mux_poll: move frames between the link and the channel queues
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		uint8_t channels	Bit per channel that received data
+ ************************************************************************/
+
+extern uint8_t mux_poll()
+{
+
+	uint8_t received;
+
+	received = receive_frames();
+	send_frames();
+
+	return received;
+
+}
+
+/************************************************************************
+ * mux_send: queue data on a channel
+ *
+ * Parameters:
+ *		uint8_t channel		The channel
+ *		uint8_t *data		The data
+ *		uint8_t length		Bytes of data
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if nothing was queued
+ *
+ * Queued as length, then data. The frame goes out on a later mux_poll.
+ ************************************************************************/
+
+extern return_code_t mux_send(uint8_t channel, uint8_t *data, uint8_t length)
+{
+
+	struct queue *queue;
+	uint8_t i;
+
+	if (channel >= channel_count || length == 0 || length > MUX_FRAME_SIZE)
+		return SERIAL_ERROR;
+
+	queue = &tx_queues[channel];
+	if (queue->size - queue->count < 1 + length)
+		return SERIAL_ERROR;
+
+	queue_put(queue, length);
+	for (i = 0; i < length; i++)
+		queue_put(queue, data[i]);
+
+	return SERIAL_OK;
+
+}
+
+/************************************************************************
+ * mux_data_pending: check a channel for received data
+ ************************************************************************/
+
+extern uint8_t mux_data_pending(uint8_t channel)
+{
+
+	if (channel >= channel_count)
+		return 0;
+
+	return rx_queues[channel].count;
+
+}
+
+/************************************************************************
+ * mux_get_char: get a byte from a channel's receive queue
+ ************************************************************************/
+
+extern uint8_t mux_get_char(uint8_t channel)
+{
+
+	if (!mux_data_pending(channel))
+		return 0;
+
+	return queue_get(&rx_queues[channel]);
+
+}
+
+/************************************************************************
+ * mux_get_dropped: count of frames dropped for a full receive queue
+ ************************************************************************/
+
+extern uint16_t mux_get_dropped(uint8_t channel)
+{
+
+	if (channel >= channel_count)
+		return 0;
+
+	return dropped[channel];
+
+}
+
+/************************************************************************
+ * mux_get_errors: count of bytes dropped looking for a valid frame
+ ************************************************************************/
+
+extern uint16_t mux_get_errors()
+{
+
+	return mux_errors;
+
+}
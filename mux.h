@@ -0,0 +1,160 @@
+/************************************************************************
+ * libserial channel multiplexer
+ *
+ * Carries several byte streams (e.g. logs, telemetry and control) over
+ * one link, each with its own receive and send queue. Include serial.h
+ * before this file.
+ *
+ * Frames, both ways: MUX_SYNC, channel, length, data, CRC. length is 1
+ * to MUX_FRAME_SIZE. The CRC is a CRC-8, polynomial 0x07 and starting
+ * at 0 (avr-libc's _crc8_ccitt_update), over channel, length and data.
+ * Data is not escaped. Both ends have to use the same channel numbers.
+ ************************************************************************/
+
+#ifndef MUX_CHANNELS
+#define MUX_CHANNELS				4			// At most 8
+#endif
+#ifndef MUX_FRAME_SIZE
+#define MUX_FRAME_SIZE				16			// In bytes, data per frame
+#endif
+
+#define MUX_NONE					0xff		// No channel
+#define MUX_SYNC					0x7e		// Frame start
+
+/************************************************************************
+ * struct mux_channel: a channel's queues
+ *
+ * Members:
+ *		uint8_t *rx_data		Receive queue, read with mux_get_char
+ *		uint8_t rx_size			Its size in bytes
+ *		uint8_t *tx_data		Send queue, filled by mux_send
+ *		uint8_t tx_size			Its size in bytes. Each frame takes one
+ *								byte more than its data.
+ *		uint8_t priority		Higher is sent first. Channels of the same
+ *								priority take turns, frame by frame.
+ ************************************************************************/
+
+struct mux_channel {
+	uint8_t *rx_data;
+	uint8_t rx_size;
+	uint8_t *tx_data;
+	uint8_t tx_size;
+	uint8_t priority;
+};
+
+/************************************************************************
+ * struct mux_init: multiplexer setup
+ *
+ * Members:
+ *		struct mux_channel *channels	Channel table, channel 0 first
+ *		uint8_t channel_count			Entries, 1 to MUX_CHANNELS
+ ************************************************************************/
+
+struct mux_init {
+	struct mux_channel *channels;
+	uint8_t channel_count;
+};
+
+/************************************************************************
+ * mux_initialise: set up the link and the channels
+ *
+ * Parameters:
+ *		struct serial_init *serial_init	Passed on to serial_initialise
+ *		struct mux_init *mux_init		Channel table, copied. The queues
+ *										stay the application's.
+ *
+ * Returns:
+ *		SERIAL_ERROR if the channel count is invalid or serial_initialise
+ *		fails
+ *		SERIAL_OK otherwise
+ *
+ * Starts receiving. Interrupts have to be enabled by the caller.
+ ************************************************************************/
+
+extern return_code_t mux_initialise(struct serial_init *serial_init,
+	struct mux_init *mux_init);
+
+/************************************************************************
+ * mux_poll: move frames between the link and the channel queues
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		uint8_t channels	Bit per channel that received data
+ *
+ * Call from the main loop. A received frame that does not fit its
+ * channel's queue is dropped, without holding up the other channels.
+ * After line noise or a lost byte, reception picks up again at the next
+ * MUX_SYNC that starts a frame with a good CRC.
+ * Frames are handed to the link one by one, with at most about one
+ * frame waiting ahead, so a new high priority frame never queues behind
+ * a backlog of low priority ones.
+ ************************************************************************/
+
+extern uint8_t mux_poll();
+
+/************************************************************************
+ * mux_send: queue data on a channel
+ *
+ * Parameters:
+ *		uint8_t channel		The channel
+ *		uint8_t *data		The data, sent as one frame
+ *		uint8_t length		Bytes of data, 1 to MUX_FRAME_SIZE
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if the channel or length is invalid or the channel's
+ *		send queue is full. Nothing is queued then.
+ ************************************************************************/
+
+extern return_code_t mux_send(uint8_t channel, uint8_t *data, uint8_t length);
+
+/************************************************************************
+ * mux_data_pending: check a channel for received data
+ *
+ * Parameters:
+ *		uint8_t channel		The channel
+ *
+ * Returns:
+ *		uint8_t length	Number of bytes in its receive queue
+ ************************************************************************/
+
+extern uint8_t mux_data_pending(uint8_t channel);
+
+/************************************************************************
+ * mux_get_char: get a byte from a channel's receive queue
+ *
+ * Parameters:
+ *		uint8_t channel		The channel
+ *
+ * Returns:
+ *		uint8_t data	The byte. Check mux_data_pending first.
+ ************************************************************************/
+
+extern uint8_t mux_get_char(uint8_t channel);
+
+/************************************************************************
+ * mux_get_dropped: count of frames dropped for a full receive queue
+ *
+ * Parameters:
+ *		uint8_t channel		The channel
+ *
+ * Returns:
+ *		uint16_t frames	Since initialisation. Wraps around.
+ ************************************************************************/
+
+extern uint16_t mux_get_dropped(uint8_t channel);
+
+/************************************************************************
+ * mux_get_errors: count of bytes dropped looking for a valid frame
+ *
+ * Bytes outside frames, and each MUX_SYNC that led to a bad header or
+ * CRC.
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		uint16_t errors	Since initialisation. Wraps around.
+ ************************************************************************/
+
+extern uint16_t mux_get_errors();
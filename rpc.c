@@ -0,0 +1,151 @@
+/************************************************************************
+ * libserial binary RPC
+ *
+ * A request is handed to its handler where it sits at the front of the
+ * receive buffer, and the handler writes its reply straight into the TX
+ * buffer, behind a length and opcode filled in afterwards. Nothing is
+ * copied, and the request goes in a single serial_drop_data.
+ ************************************************************************/
+
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "serial.h"
+#include "rpc.h"
+
+#if defined(TX_ONLY) || defined(RX_ONLY)
+#error "rpc.c needs both RX and TX"
+#endif
+
+#if RPC_REPLY_SIZE < 2 || RPC_REPLY_SIZE > TX_BUFFER_SIZE
+#error "RPC_REPLY_SIZE has to fit the TX buffer and the reply header"
+#endif
+
+#define HEADER_SIZE			2		// Length and opcode
+
+
+/************************************************************************
+ * File global variables
+ ************************************************************************/
+
+static struct rpc_init rpc_config;
+
+static uint16_t rpc_errors = 0;
+
+
+/************************************************************************
+ * Public functions
+ ************************************************************************/
+
+/************************************************************************
+ * rpc_initialise: set up the link and the dispatcher
+ *
+ * Parameters:
+ *		struct serial_init *serial_init	Passed on to serial_initialise
+ *		struct rpc_init *rpc_init		Handler table
+ *
+ * Returns:
+ *		SERIAL_ERROR if serial_initialise fails
+ *		SERIAL_OK otherwise
+ ************************************************************************/
+
+extern return_code_t rpc_initialise(struct serial_init *serial_init,
+	struct rpc_init *rpc_init)
+{
+
+	if (serial_initialise(serial_init) != SERIAL_OK)
+		return SERIAL_ERROR;
+
+	rpc_config = *rpc_init;
+	rpc_errors = 0;
+
+	serial_enable_receive();
+
+	return SERIAL_OK;
+
+}
+
+/************************************************************************
+ * rpc_poll: handle the next request
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		uint8_t opcode	Opcode of the request handled, or RPC_NONE
+ *
+ * The request is left in the receive buffer until its reply is queued,
+ * so a full TX buffer holds requests back instead of losing them.
+ ************************************************************************/
+
+extern uint8_t rpc_poll()
+{
+
+	rpc_handler_t handler = NULL;
+	uint8_t *request;
+	uint8_t *reply;
+	uint16_t room;
+	uint8_t length, opcode, reply_length;
+
+	if (serial_peek_char(0, &length) != SERIAL_OK)
+		return RPC_NONE;
+
+	if (length == 0 || length >= RX_BUFFER_SIZE) {
+		serial_drop_data(1);
+		rpc_errors++;
+		return RPC_NONE;
+	}
+
+	if ((request = serial_peek_data(length + 1)) == NULL)
+		return RPC_NONE;
+
+	opcode = request[1];
+	if (opcode < rpc_config.handler_count)
+		handler = pgm_read_ptr(&rpc_config.handlers[opcode]);
+
+	reply = serial_reserve_data(&room);
+	if (room < RPC_REPLY_SIZE) {
+		serial_commit_data(0);
+		return RPC_NONE;
+	}
+	if (room > HEADER_SIZE + 0xfe)
+		room = HEADER_SIZE + 0xfe;	// Keep clear of RPC_NO_REPLY
+
+	if (handler == NULL) {
+		reply_length = 0;
+		reply[1] = opcode | RPC_ERROR_FLAG;
+		rpc_errors++;
+	} else {
+		reply_length = handler(request + HEADER_SIZE, length - 1,
+			reply + HEADER_SIZE, room - HEADER_SIZE);
+		reply[1] = opcode;
+	}
+
+	if (reply_length == RPC_NO_REPLY) {
+		serial_commit_data(0);
+	} else if (reply_length > room - HEADER_SIZE) {
+		// Handler overran its room: nothing of it is fit to send
+		serial_commit_data(0);
+		rpc_errors++;
+	} else {
+		reply[0] = reply_length + 1;
+		serial_commit_data(reply_length + HEADER_SIZE);
+	}
+
+	serial_drop_data(length + 1);
+
+	return opcode;
+
+}
+
+/************************************************************************
+ * rpc_get_errors: count of bad length bytes, unknown opcodes and
+ * handlers that returned more than their room
+ ************************************************************************/
+
+extern uint16_t rpc_get_errors()
+{
+
+	return rpc_errors;
+
+}
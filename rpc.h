@@ -0,0 +1,113 @@
+/************************************************************************
+ * libserial binary RPC
+ *
+ * Dispatches length-prefixed request frames to handlers looked up by
+ * opcode in a table in flash. Requests are read and replies written in
+ * place in the libserial buffers. Include serial.h before this file.
+ *
+ * Frames, both ways: length, opcode, data. length counts the opcode and
+ * the data, 1 to RX_BUFFER_SIZE - 1. A reply carries the opcode of its
+ * request, or the opcode | RPC_ERROR_FLAG with no data if there is no
+ * handler for it.
+ ************************************************************************/
+
+#ifndef RPC_REPLY_SIZE
+#define RPC_REPLY_SIZE				16			// In bytes, room kept for a reply
+#endif
+
+#define RPC_ERROR_FLAG				0x80		// Reply: unknown opcode
+
+#define RPC_NO_REPLY				0xff		// From a handler: send nothing
+#define RPC_NONE					0xff		// No request, from rpc_poll
+
+/************************************************************************
+ * rpc_handler_t: request handler
+ *
+ * Parameters:
+ *		const uint8_t *request	Request data, after the opcode, in the
+ *								receive buffer
+ *		uint8_t length			Bytes of request data
+ *		uint8_t *reply			Where to write the reply data, in the TX
+ *								buffer
+ *		uint8_t room			Bytes free at reply, at least
+ *								RPC_REPLY_SIZE - 2
+ *
+ * Returns:
+ *		uint8_t length	Bytes of reply data written, or RPC_NO_REPLY.
+ *						More than room counts as an error and sends
+ *						no reply
+ *
+ * The TX buffer is locked while a handler runs: it must not call
+ * serial_put_char or serial_send_data, and should be quick.
+ ************************************************************************/
+
+typedef uint8_t (*rpc_handler_t)(const uint8_t *request, uint8_t length,
+	uint8_t *reply, uint8_t room);
+
+/************************************************************************
+ * struct rpc_init: dispatcher setup
+ *
+ * Members:
+ *		const rpc_handler_t *handlers	Handler table in flash (PROGMEM),
+ *										indexed by opcode. NULL for unused
+ *										opcodes.
+ *		uint8_t handler_count			Entries in the table
+ *
+ * e.g.
+ *		static const rpc_handler_t handlers[] PROGMEM = {
+ *			rpc_ping,		// Opcode 0
+ *			NULL,
+ *			rpc_read_adc,	// Opcode 2
+ *		};
+ ************************************************************************/
+
+struct rpc_init {
+	const rpc_handler_t *handlers;
+	uint8_t handler_count;
+};
+
+/************************************************************************
+ * rpc_initialise: set up the link and the dispatcher
+ *
+ * Parameters:
+ *		struct serial_init *serial_init	Passed on to serial_initialise
+ *		struct rpc_init *rpc_init		Handler table, copied
+ *
+ * Returns:
+ *		SERIAL_ERROR if serial_initialise fails
+ *		SERIAL_OK otherwise
+ *
+ * Starts receiving. Interrupts have to be enabled by the caller.
+ ************************************************************************/
+
+extern return_code_t rpc_initialise(struct serial_init *serial_init,
+	struct rpc_init *rpc_init);
+
+/************************************************************************
+ * rpc_poll: handle the next request
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		uint8_t opcode	Opcode of the request handled, or RPC_NONE if no
+ *						complete request was in, or there was not yet
+ *						RPC_REPLY_SIZE bytes of room for the reply
+ *
+ * Call from the main loop. A length byte of 0, or too large for the
+ * receive buffer, cannot start a frame: it is dropped, to find the next
+ * one.
+ ************************************************************************/
+
+extern uint8_t rpc_poll();
+
+/************************************************************************
+ * rpc_get_errors: count of bad length bytes, unknown opcodes and
+ * handlers that returned more than their room
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		uint16_t errors	Since initialisation. Wraps around.
+ ************************************************************************/
+
+extern uint16_t rpc_get_errors();
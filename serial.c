@@ -11,9 +11,29 @@
 #include <string.h>
 #include "serial.h"
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
 
 #define NUM_SPEED		   6 
 #define PRESCALER_DIVISOR   8
+#define SPEED_CUSTOM		0xff	// serial_config->speed for a speed in baud
+
+#ifndef F_CPU
+#define F_CPU				8000000UL	// The speed tables below assume this
+#endif
+
+// Speeds in baud: allowed error in per mille, shortest tick in CPU cycles,
+// slowest speed and the PCINT0_vect time to reading TCNT1, which offsets
+// the sample point. MIN_TICK_CYCLES only keeps out speeds no build can
+// reach (DMX at 8MHz); it is not what the ISRs cost. With the default
+// buffers that is far more, so speeds well below the limit can still be
+// too fast: make check tells
+#ifndef SERIAL_BAUD_TOLERANCE
+#define SERIAL_BAUD_TOLERANCE	20
+#endif
+#define MIN_TICK_CYCLES			64		// 62500 baud at 8MHz
+#define MIN_BAUD				8		// The 1/8 s statistics window holds a bit
+#define PCINT_LATENCY_CYCLES	24
 
 // Status codes
 #define SERIAL_IDLE						0b00000000
@@ -30,6 +50,132 @@
 
 #define PIN_INVALID		99
 
+// Trace events: high nibble is the event, low nibble an argument
+#define TRACE_VERSION					1
+#define TRACE_START_BIT					0x10
+#define TRACE_START_BIT_SPURIOUS		0x20
+#define TRACE_SAMPLE					0x30	// | bit number << 1 | value
+#define TRACE_STOP_BIT_OK				0x40
+#define TRACE_STOP_BIT_BAD				0x50
+#define TRACE_RECEIVE_OVERFLOW			0x60
+#define TRACE_TX_LOCK_RETRY				0x70
+
+#if defined(TX_ONLY) && defined(RX_ONLY)
+#error "TX_ONLY and RX_ONLY are mutually exclusive"
+#endif
+
+#if defined(RX_ONLY) && defined(SERIAL_TRACE)
+#error "SERIAL_TRACE needs the TX path to dump the trace"
+#endif
+
+#if defined(RX_ONLY) && defined(SERIAL_SNAPSHOT)
+#error "SERIAL_SNAPSHOT needs the TX path to send the snapshot"
+#endif
+
+#if defined(RX_ONLY) && defined(SERIAL_RS485)
+#error "SERIAL_RS485 drives the transmitter, so needs the TX path"
+#endif
+
+#if defined(SERIAL_LIN) && defined(TX_ONLY)
+#error "SERIAL_LIN detects break and sync in the RX path"
+#endif
+
+#if defined(SERIAL_LIN) && defined(SERIAL_9BIT)
+#error "SERIAL_LIN uses 8N1 frames"
+#endif
+
+#if defined(SERIAL_NMEA) && defined(TX_ONLY)
+#error "SERIAL_NMEA filters in the RX path"
+#endif
+
+#if defined(SERIAL_NMEA) && defined(SERIAL_LIN)
+#error "SERIAL_NMEA and SERIAL_LIN both frame the received data"
+#endif
+
+#if defined(SERIAL_ECHO) && (defined(TX_ONLY) || defined(RX_ONLY))
+#error "SERIAL_ECHO compares received against sent data, so needs both paths"
+#endif
+
+#ifdef SERIAL_BAUD
+// Work out the timer setting for a fixed speed at compile time, same as
+// baud_timing does at run time: the smallest prescaler (CS1[3:0] selects
+// CK / 2^(CS1 - 1)) that gets a tick into the 8 bit counter
+#define BAUD_COUNTS(cs)		((F_CPU + (SERIAL_BAUD << ((cs) - 1))) / \
+							(2UL * SERIAL_BAUD << ((cs) - 1)))
+#if BAUD_COUNTS(1) <= 256
+#define BAUD_CLOCK_SELECT	1
+#elif BAUD_COUNTS(2) <= 256
+#define BAUD_CLOCK_SELECT	2
+#elif BAUD_COUNTS(3) <= 256
+#define BAUD_CLOCK_SELECT	3
+#elif BAUD_COUNTS(4) <= 256
+#define BAUD_CLOCK_SELECT	4
+#elif BAUD_COUNTS(5) <= 256
+#define BAUD_CLOCK_SELECT	5
+#elif BAUD_COUNTS(6) <= 256
+#define BAUD_CLOCK_SELECT	6
+#elif BAUD_COUNTS(7) <= 256
+#define BAUD_CLOCK_SELECT	7
+#elif BAUD_COUNTS(8) <= 256
+#define BAUD_CLOCK_SELECT	8
+#elif BAUD_COUNTS(9) <= 256
+#define BAUD_CLOCK_SELECT	9
+#elif BAUD_COUNTS(10) <= 256
+#define BAUD_CLOCK_SELECT	10
+#elif BAUD_COUNTS(11) <= 256
+#define BAUD_CLOCK_SELECT	11
+#elif BAUD_COUNTS(12) <= 256
+#define BAUD_CLOCK_SELECT	12
+#elif BAUD_COUNTS(13) <= 256
+#define BAUD_CLOCK_SELECT	13
+#elif BAUD_COUNTS(14) <= 256
+#define BAUD_CLOCK_SELECT	14
+#elif BAUD_COUNTS(15) <= 256
+#define BAUD_CLOCK_SELECT	15
+#else
+#error "SERIAL_BAUD is too slow for Timer1"
+#endif
+
+#define BAUD_OCR			(BAUD_COUNTS(BAUD_CLOCK_SELECT) - 1)
+#define BAUD_ACTUAL			(F_CPU / (2UL * BAUD_COUNTS(BAUD_CLOCK_SELECT) << \
+							(BAUD_CLOCK_SELECT - 1)))
+
+#if F_CPU / (2UL * SERIAL_BAUD) < MIN_TICK_CYCLES
+#error "SERIAL_BAUD is too fast for the ISRs at this F_CPU (e.g. DMX at 8MHz)"
+#endif
+#if SERIAL_BAUD > 4UL * 0xffff || SERIAL_BAUD < MIN_BAUD
+#error "SERIAL_BAUD is out of range"
+#endif
+#if (BAUD_ACTUAL > SERIAL_BAUD ? BAUD_ACTUAL - SERIAL_BAUD : SERIAL_BAUD - BAUD_ACTUAL) \
+		* 1000 > SERIAL_BAUD_TOLERANCE * SERIAL_BAUD
+#error "SERIAL_BAUD cannot be made within SERIAL_BAUD_TOLERANCE at this F_CPU"
+#endif
+#endif
+
+// Frame format: 8N1, or 9N1 with the 9th bit marking address bytes
+#ifdef SERIAL_9BIT
+#define DATA_BITS						9
+#else
+#define DATA_BITS						8
+#endif
+#define FRAME_BITS						(DATA_BITS + 2)
+
+#define SNAPSHOT_VERSION				2		// 2: baud added
+#define SNAPSHOT_SIZE					28		// Bytes from features on
+
+// Snapshot feature flags, telling the collector which fields are valid
+#define SNAPSHOT_FEATURE_TX_ONLY		0b00000001
+#define SNAPSHOT_FEATURE_TIMESTAMPS		0b00000100
+#define SNAPSHOT_FEATURE_TRACE			0b00001000
+#define SNAPSHOT_FEATURE_LOAD			0b00010000
+#define SNAPSHOT_FEATURE_STATS			0b00100000
+
+#ifdef SERIAL_TRACE
+#define TRACE(event)	trace_event(event)
+#else
+#define TRACE(event)
+#endif
+
 
 
 /************************************************************************
@@ -47,26 +193,164 @@ static uint8_t timer_ocr_values[NUM_SPEED] = {208, 52, 25, 12, 8, 3};
 static uint8_t sample_offset_treshold[NUM_SPEED] = {120, 30, 14, 7, 5, 1};
 #endif
 
+// Speeds in multiples of 2400 baud, to work out tick dividers when RX
+// and TX run at different speeds off the same timer
+static uint8_t speed_units[NUM_SPEED] = {1, 4, 8, 16, 24, 48};
+
+#ifdef SERIAL_STATS
+// Statistics window: 1/8 s worth of ticks (two per bit), so baud / 4
+static uint16_t stats_window_ticks[NUM_SPEED] = {600, 2400, 4800, 9600, 14400, 28800};
+static uint16_t stats_window_length = 0;	// Ticks, for the current speed
+#endif
+
 struct buffer {
 	uint8_t lock;
 	uint8_t *data;
 	uint16_t top;		// Top: points to where next byte will be written
-	uint8_t dirty;
+	uint8_t dirty;		// RX: bytes read, for the bottom handler to shift out
 };
 
 static volatile struct buffer rx_buffer = {0, NULL, 0, 0};
-static volatile struct buffer tx_buffer = {0, NULL, 0, 0};
-
 static volatile uint8_t rx_bit_counter = 0;
+
+#ifndef RX_ONLY
+static volatile struct buffer tx_buffer = {0, NULL, 0, 0};
 static volatile uint8_t tx_bit_counter = 0;
 static volatile uint8_t tx_byte = 0;
 static volatile uint8_t tx_phase = 0;
+static volatile uint8_t tx_ticks_per_bit = 2;
+static volatile uint8_t tx_active = 0;	// From start bit to end of last stop bit
+#endif
 
 #ifndef TX_ONLY
 static volatile uint8_t rx_byte = 0;
 static volatile uint8_t rx_phase = 0;
 static volatile uint8_t rx_sample_countdown = 0;
+static volatile uint8_t rx_ticks_per_bit = 2;
+static volatile uint8_t rx_start_countdown = 2;	// Ticks to the middle of bit 0, minus 1
 static volatile uint8_t rx_start_bit_timecount = 0;
+#ifdef SERIAL_9BIT
+static volatile uint8_t rx_address_mark = 0;	// 9th bit of the frame
+static volatile uint8_t rx_address = 0;			// Our address
+static volatile uint8_t rx_addressed = 0;		// Last address byte was ours
+#endif
+#endif
+
+#ifdef SERIAL_TICKS
+static volatile uint16_t serial_ticks = 0;
+#endif
+
+#ifdef RX_TIMESTAMPS
+static uint16_t *rx_timestamps = NULL;	// Runs parallel to rx_buffer.data
+#endif
+
+#ifdef SERIAL_LOAD
+// Timer counts spent in the ISRs. Window is 256 ticks: load_window_ticks
+// wraps around at the end of it. A full window is up to 256 * 256 counts,
+// more when the ISRs overrun their ticks, so the counts need 32 bits
+static volatile uint32_t load_counts = 0;
+static volatile uint32_t load_counts_last = 0;
+static volatile uint8_t load_window_ticks = 0;
+static volatile uint8_t load_window_valid = 0;
+#endif
+
+#ifdef SERIAL_STATS
+// Frames take 10 bit slots whether they make it to the buffer or not, so
+// frames and bytes are counted separately. Published every window.
+struct stats_counters {
+	uint16_t tx_frames;
+	uint16_t rx_frames;
+	uint16_t rx_bytes;
+};
+
+static struct stats_counters stats_current = {0, 0, 0};
+static volatile struct stats_counters stats_last = {0, 0, 0};
+static volatile uint16_t stats_window_countdown = 0;
+static volatile uint8_t stats_window_valid = 0;
+#endif
+
+#ifdef SERIAL_LIN
+// LIN header: break (a 0 byte with a bad stop bit), sync 0x55 timed by
+// PCINT0_vect, then the protected identifier
+#define LIN_IDLE						0
+#define LIN_SYNC						1
+#define LIN_PID							2
+
+#define LIN_SYNC_EDGES					5		// Falling edges in 0x55, 8 bits apart
+
+static volatile uint8_t lin_state = LIN_IDLE;
+static volatile uint8_t lin_edges = 0;
+static volatile uint16_t lin_first_edge = 0;	// In timer counts
+static volatile uint8_t lin_pid = 0;
+static volatile uint8_t lin_header = 0;			// New PID in lin_pid
+static volatile uint8_t lin_stored = 0;			// Bytes stored, wraps
+static volatile uint8_t lin_mark = 0;			// lin_stored at the PID
+#endif
+
+#ifdef SERIAL_NMEA
+// NMEA sentences are stored as they come in, from '$' up to the checksum
+// digits, and only become readable when the checksum is good. Anything
+// else is taken off the buffer again straight away
+#define NMEA_IDLE						0		// Dropping until '$'
+#define NMEA_BODY						1
+#define NMEA_CHECKSUM_HIGH				2
+#define NMEA_CHECKSUM_LOW				3
+
+#define NMEA_MAX_LENGTH					82		// '$' up to the checksum
+#define NMEA_PREFIX_LENGTH				5		// Talker and sentence type
+#define NMEA_MAX_FILTERS				8
+
+#if RX_BUFFER_SIZE < NMEA_MAX_LENGTH + 1
+#error "SERIAL_NMEA needs an RX_BUFFER_SIZE that holds a sentence and its '\n'"
+#endif
+
+static volatile uint8_t nmea_state = NMEA_IDLE;
+static volatile uint16_t nmea_start = 0;		// rx_buffer.top at the '$'
+static volatile uint16_t nmea_committed = 0;	// Bytes of good sentences
+static volatile uint8_t nmea_checksum = 0;
+static volatile uint8_t nmea_position = 0;		// Characters after the '$'
+static volatile uint8_t nmea_candidates = 0;	// Bit per filter still matching
+static volatile uint8_t nmea_ended = 0;		// Bit per filter matched up to its end
+static const char * const *nmea_filters = NULL;
+static volatile uint8_t nmea_filter_count = 0;
+
+// Bytes the application may read
+#define RX_PENDING						nmea_committed
+#else
+#define RX_PENDING						rx_buffer.top
+#endif
+
+#ifdef SERIAL_ECHO
+// Our own byte as it should come back off a shared bus. Set at the start
+// bit, checked when the receiver has the byte, half a bit before the end
+// of our stop bit
+static volatile uint8_t echo_byte = 0;
+static volatile uint8_t echo_pending = 0;
+static volatile uint16_t echo_collisions = 0;
+#endif
+
+#ifdef SERIAL_SNAPSHOT
+static volatile uint16_t rx_overflows = 0;
+static volatile uint16_t rx_frame_errors = 0;	// Bad stop bits
+#endif
+
+#ifdef SERIAL_TRACE
+// The ring index wraps with a mask and trace_count is a byte
+#if TRACE_BUFFER_SIZE < 1 || TRACE_BUFFER_SIZE > 128 || \
+	(TRACE_BUFFER_SIZE & (TRACE_BUFFER_SIZE - 1))
+#error "TRACE_BUFFER_SIZE has to be a power of 2, at most 128"
+#endif
+
+struct trace_entry {
+	uint8_t event;
+	uint8_t tick;		// Low byte of serial_ticks
+	uint8_t timecount;	// TCNT1
+};
+
+static struct trace_entry trace_buffer[TRACE_BUFFER_SIZE];
+static volatile uint8_t trace_head = 0;		// Next entry to write
+static volatile uint8_t trace_count = 0;
+static volatile uint8_t trace_frozen = 0;
 #endif
 
 struct serial_config_t {
@@ -74,7 +358,22 @@ struct serial_config_t {
 	volatile uint8_t *tx_port;
 	uint8_t	rx_pin;	
 	volatile uint8_t *rx_port;
-	serial_speed_t speed;
+#ifdef SERIAL_RS485
+	uint8_t de_pin;
+	volatile uint8_t *de_port;
+#endif
+	serial_speed_t speed;	// Timer speed, or SPEED_CUSTOM
+	uint32_t baud;			// Timer speed in baud: a tick is half its bit
+	uint8_t clock_select;	// Timer1 CS1[3:0] bits
+#ifdef SERIAL_LOAD
+	uint8_t load_overhead;	// LOAD_ISR_OVERHEAD_CYCLES in timer counts
+#endif
+#ifndef TX_ONLY
+	uint8_t rx_threshold;	// Sample offset treshold, in timer counts
+#endif
+#ifdef SERIAL_LIN
+	uint8_t nominal_ocr;	// OCR for the configured speed, before autobaud
+#endif
 };
 
 struct serial_config_t *serial_config;
@@ -90,7 +389,7 @@ struct serial_config_t *serial_config;
  *
  * Parameters:
  *		char *pin
- *		serial_direction_t dir  TX or RX port?
+ *		serial_direction_t dir  TX, RX or RS-485 driver enable port?
  *
  * This library is written for ATTinyx5 which only has PORTB, but the
  * vestiges of multiple port support are in here. 
@@ -101,6 +400,7 @@ struct serial_config_t *serial_config;
 typedef enum {
 	SERIAL_DIR_TX,
 	SERIAL_DIR_RX,
+	SERIAL_DIR_DE,
 } serial_direction_t;
 
 static return_code_t setup_io(
@@ -141,6 +441,20 @@ static return_code_t setup_io(
 			serial_config->rx_port = &PINB;
 			break;
 
+#ifdef SERIAL_RS485
+		case SERIAL_DIR_DE:
+
+			DDRB |= (1 << pin_number);
+			PORTB &= ~(1 << pin_number);  // Low: driver off
+			serial_config->de_pin = pin_number;
+			serial_config->de_port = &PORTB;
+			break;
+#endif
+
+		default:
+
+			return SERIAL_ERROR;
+
 	}
 
 
@@ -166,6 +480,67 @@ static void move_connection_state(uint8_t src_state, uint8_t dst_state)
 
 }
 
+#ifdef SERIAL_TRACE
+/************************************************************************
+ * trace_event: record an event in the trace ring
+ *
+ * Parameters:
+ *		uint8_t event	The TRACE_* event code
+ *
+ * Only called from interrupt. Overwrites the oldest entry when full.
+ ************************************************************************/
+
+static inline void trace_event(uint8_t event)
+{
+
+	struct trace_entry *entry;
+
+	if (trace_frozen)
+		return;
+
+	entry = &trace_buffer[trace_head];
+	entry->timecount = TCNT1;
+	entry->tick = serial_ticks;
+	entry->event = event;
+
+	trace_head = (trace_head + 1) & (TRACE_BUFFER_SIZE - 1);
+	if (trace_count < TRACE_BUFFER_SIZE)
+		trace_count++;
+
+}
+#endif
+
+#ifdef SERIAL_LOAD
+/************************************************************************
+ * account_isr_time: add the time spent in an ISR to the load window
+ *
+ * Parameters:
+ *		uint8_t entry	TCNT1 as read at the start of the ISR
+ *
+ * Only called from interrupt, just before it returns. TCNT1 wraps at
+ * OCR1C, so an ISR that started before the wrap has to be corrected.
+ * Prologue and epilogue are not seen by the TCNT1 reads and are covered
+ * by a fixed allowance instead, scaled to the prescaler by program_timer.
+ ************************************************************************/
+
+#define LOAD_ISR_OVERHEAD_CYCLES	40	// Entry and exit, unseen by TCNT1
+
+static inline void account_isr_time(uint8_t entry)
+{
+
+	uint8_t exit = TCNT1;
+
+	if (exit < entry)
+		exit += OCR1C + 1 - entry;
+	else
+		exit -= entry;
+
+	load_counts += exit + serial_config->load_overhead;
+
+}
+#endif
+
+#ifndef RX_ONLY
 /************************************************************************
  * send_data_bit: set the tx pin to a new data bit
  *
@@ -185,31 +560,36 @@ static void send_data_bit(uint8_t bit)
 }
 
 /************************************************************************
- * shift_buffer_down: shift out lowest byte of a buffer, with locking
+ * shift_buffer_down: shift out the lowest bytes of a buffer, with locking
  *
  * Parameters:
  *		struct buffer *buffer	The subject buffer
+ *		uint8_t count			Number of bytes to shift out, at most top
  *
  * Returns:
  *		SERIAL_OK on success
- *		SERIAL_ERROR if buffer was locked
+ *		SERIAL_ERROR if buffer was locked or holds fewer than count bytes
  *
- * New top+1 byte is set to 0
+ * The byte at the new top is set to 0
  ************************************************************************/
 
-static return_code_t shift_buffer_down(volatile struct buffer *buffer)
+static return_code_t shift_buffer_down(volatile struct buffer *buffer, uint8_t count)
 {
 
 	return_code_t retval = SERIAL_ERROR;
-	uint8_t i = 0;
+	uint16_t i = 0;
+
+	if (count > buffer->top)
+		return SERIAL_ERROR;
 
 	if (!buffer->lock) {
 
 		buffer->lock = 1;
+		buffer->top -= count;
 		for (i=0; i < buffer->top ; i++) {
-			buffer->data[i] = buffer->data[i+1];
+			buffer->data[i] = buffer->data[i + count];
 		}
-		buffer->data[(buffer->top)--] = 0;
+		buffer->data[buffer->top] = 0;
 		buffer->lock = 0;
 		retval = SERIAL_OK;
 
@@ -217,6 +597,38 @@ static return_code_t shift_buffer_down(volatile struct buffer *buffer)
 
 	return retval;
 
+}
+#endif
+
+/************************************************************************
+ * shift_rx_buffer: shift out the bytes read from the receive buffer
+ *
+ * Parameters:
+ *		uint8_t count	Number of bytes to shift out, at most top
+ *
+ * Returns: nothing
+ *
+ * Only called by the bottom handler. store_data runs in the same ISR,
+ * so the buffer cannot be locked here. With RX_TIMESTAMPS the timestamps
+ * move in the same loop, so the ISR walks the buffer once.
+ ************************************************************************/
+
+static void shift_rx_buffer(uint8_t count)
+{
+
+	uint16_t i;
+
+	rx_buffer.lock = 1;
+	rx_buffer.top -= count;
+	for (i = 0; i < rx_buffer.top; i++) {
+		rx_buffer.data[i] = rx_buffer.data[i + count];
+#ifdef RX_TIMESTAMPS
+		rx_timestamps[i] = rx_timestamps[i + count];
+#endif
+	}
+	rx_buffer.data[rx_buffer.top] = 0;
+	rx_buffer.lock = 0;
+
 }
 
 #ifndef TX_ONLY
@@ -241,12 +653,25 @@ static return_code_t store_data(volatile struct buffer *buffer, uint8_t data)
 
 	if (buffer->top < RX_BUFFER_SIZE) {
 
+#ifdef RX_TIMESTAMPS
+		rx_timestamps[buffer->top] = serial_ticks;
+#endif
 		buffer->data[(buffer->top)++] = data;
 		retval = SERIAL_OK;
+#ifdef SERIAL_STATS
+		stats_current.rx_bytes++;
+#endif
+#ifdef SERIAL_LIN
+		lin_stored++;
+#endif
 
 	} else {
 
 		// Drat
+		TRACE(TRACE_RECEIVE_OVERFLOW);
+#ifdef SERIAL_SNAPSHOT
+		rx_overflows++;
+#endif
 		move_connection_state(
 			SERIAL_RECEIVING_DATA,
 			SERIAL_RECEIVE_OVERFLOW
@@ -257,8 +682,141 @@ static return_code_t store_data(volatile struct buffer *buffer, uint8_t data)
 
 	return retval;
 
+}
+
+#ifdef SERIAL_NMEA
+/************************************************************************
+ * nmea_discard: take the sentence being received off the buffer
+ ************************************************************************/
+
+static void nmea_discard(void)
+{
+
+	if (nmea_state != NMEA_IDLE)
+		rx_buffer.top = nmea_start;
+	nmea_state = NMEA_IDLE;
+
+}
+
+static uint8_t hex_digit(uint8_t data)
+{
+
+	if (data >= '0' && data <= '9')
+		return data - '0';
+	if (data >= 'A' && data <= 'F')
+		return data - 'A' + 10;
+	if (data >= 'a' && data <= 'f')
+		return data - 'a' + 10;
+
+	return 0xff;
+
+}
+
+/************************************************************************
+ * nmea_store: store a byte if it is part of a wanted NMEA sentence
+ *
+ * Parameters:
+ *		uint8_t data	The received byte
+ *
+ * The checksum is the XOR of everything between '$' and '*', and each of
+ * its digits is checked as it comes in. A good sentence is closed with
+ * '\n' (CR LF are not stored) and made readable. The talker and type
+ * are matched against the filters on the fly, so an unwanted sentence is
+ * dropped after a few bytes.
+ ************************************************************************/
+
+static void nmea_store(uint8_t data)
+{
+
+	uint8_t i, bit, filter;
+
+	if (data == '$') {
+		nmea_discard();
+		nmea_start = rx_buffer.top;
+		nmea_checksum = 0;
+		nmea_position = 0;
+		nmea_candidates = (1 << nmea_filter_count) - 1;
+		nmea_ended = 0;
+		if (store_data(&rx_buffer, data) == SERIAL_OK)
+			nmea_state = NMEA_BODY;
+		return;
+	}
+
+	switch (nmea_state) {
+
+		case NMEA_BODY:
+
+			if (data == '*') {
+				nmea_state = NMEA_CHECKSUM_HIGH;
+				break;
+			}
+
+			// Line end without checksum, or garbage
+			if (data < ' ' || data > '~') {
+				nmea_discard();
+				return;
+			}
+
+			nmea_checksum ^= data;
+
+			if (nmea_position < NMEA_PREFIX_LENGTH && nmea_filter_count) {
+				for (i = 0, bit = 1; i < nmea_filter_count; i++, bit <<= 1) {
+					// Never read a filter past its end, or one that
+					// has already failed and may be shorter
+					if (!(nmea_candidates & bit) || (nmea_ended & bit))
+						continue;
+					filter = nmea_filters[i][nmea_position];
+					// A filter that has ended has matched
+					if (!filter)
+						nmea_ended |= bit;
+					else if (filter != '?' && filter != data)
+						nmea_candidates &= ~bit;
+				}
+				if (!nmea_candidates) {
+					nmea_discard();
+					return;
+				}
+			}
+			nmea_position++;
+
+			break;
+
+		case NMEA_CHECKSUM_HIGH:
+
+			if (hex_digit(data) != nmea_checksum >> 4) {
+				nmea_discard();
+				return;
+			}
+			nmea_state = NMEA_CHECKSUM_LOW;
+
+			break;
+
+		case NMEA_CHECKSUM_LOW:
+
+			if (hex_digit(data) != (nmea_checksum & 0x0f) ||
+				store_data(&rx_buffer, data) != SERIAL_OK ||
+				store_data(&rx_buffer, '\n') != SERIAL_OK) {
+				nmea_discard();
+				return;
+			}
+			nmea_committed = rx_buffer.top;
+			nmea_state = NMEA_IDLE;
+
+			return;
+
+		default:
+
+			return;
+
+	}
+
+	if (rx_buffer.top - nmea_start >= NMEA_MAX_LENGTH ||
+		store_data(&rx_buffer, data) != SERIAL_OK)
+		nmea_discard();
+
 }
 #endif
+#endif
 
 /************************************************************************
  * connection_state_is: check connection state
@@ -297,6 +855,76 @@ static void disable_rx_interrupt(void) {
 
 }
 
+/************************************************************************
+ * sample_threshold: sample offset treshold for a timer setting
+ *
+ * Parameters:
+ *		uint8_t ocr				Compare value
+ *		uint8_t clock_select	CS1[3:0] bits
+ *
+ * Half a tick plus the PCINT0_vect latency, in timer counts
+ ************************************************************************/
+
+static uint8_t sample_threshold(uint8_t ocr, uint8_t clock_select)
+{
+
+	return ((uint16_t)ocr + 1) / 2 + (PCINT_LATENCY_CYCLES >> (clock_select - 1));
+
+}
+
+#ifdef SERIAL_LIN
+/************************************************************************
+ * lin_sync_edge: time a falling edge of the LIN sync byte
+ *
+ * Parameters:
+ *		uint8_t timecount	TCNT1 at PCINT0_vect entry
+ *
+ * 0x55 has falling edges at the start bit and bits 1, 3, 5 and 7, so the
+ * first and fifth are 8 bit times, 16 ticks, apart. Timing them in timer
+ * counts (ticks times OCR1C + 1, plus TCNT1) gives the master's tick to
+ * a fraction of a count, and OCR is set to match. Measurements more than
+ * about 14% off the configured speed are taken to be noise.
+ ************************************************************************/
+
+static void lin_sync_edge(uint8_t timecount)
+{
+
+	uint16_t ticks = serial_ticks;
+	uint16_t now, ocr, difference;
+	uint16_t nominal = serial_config->nominal_ocr + 1;
+
+	// A compare match that came while we held up TIM1_COMPA_vect has
+	// not been counted yet
+	if ((TIFR & (1 << OCF1A)) && timecount < OCR1C / 2)
+		ticks++;
+	now = ticks * ((uint16_t)OCR1C + 1) + timecount;
+
+	if (lin_edges++ == 0) {
+		lin_first_edge = now;
+		return;
+	}
+	if (lin_edges < LIN_SYNC_EDGES)
+		return;
+
+	lin_state = LIN_IDLE;
+
+	// Counts per tick, rounded, and the compare value for it
+	ocr = (uint16_t)(now - lin_first_edge + 8) >> 4;
+	difference = ocr > nominal ? ocr - nominal : nominal - ocr;
+	if (ocr < 2 || ocr > 256 || difference * 7 > nominal)
+		return;
+
+	OCR1A = OCR1C = ocr - 1;
+	// Do not let the counter run past the new compare value
+	if (TCNT1 >= OCR1C)
+		TCNT1 = 0;
+	serial_config->rx_threshold = sample_threshold(OCR1C, serial_config->clock_select);
+
+	lin_state = LIN_PID;
+
+}
+#endif
+
 /************************************************************************
  * Pin change interrupt 0 ISR - capture start bit for RX
  *
@@ -305,6 +933,8 @@ static void disable_rx_interrupt(void) {
  * so when we receive the start bit in the first half of a bit cycle, we
  * wait 2 timer cycles for sampling, for other case 3 timer cycles.
  * In all cases, sampling after that is every other timer cycle.
+ * When RX runs slower than the timer (see serial_set_speeds), a bit is
+ * rx_ticks_per_bit timer cycles instead of 2 and the waits scale along.
  * I should include a nice drawing of this in the documentation
  ************************************************************************/
 
@@ -315,15 +945,37 @@ ISR(PCINT0_vect)
 	// and not several clock cycles further down in the ISR
 	rx_start_bit_timecount = TCNT1;
 
+	// Another pin in PCMSK can still fire this after release_resources
+	if (serial_config == NULL)
+		return;
+
 	// Sanity check. This should be a start bit, so low
-	if (bit_is_set(serial_config->rx_port, serial_config->rx_pin)) return;
+	if (bit_is_set(*(serial_config->rx_port), serial_config->rx_pin)) {
+		TRACE(TRACE_START_BIT_SPURIOUS);
+#ifdef SERIAL_LOAD
+		account_isr_time(rx_start_bit_timecount);
+#endif
+		return;
+	}
+
+#ifdef SERIAL_LIN
+	// Sync byte edges are timed, not received
+	if (lin_state == LIN_SYNC) {
+		lin_sync_edge(rx_start_bit_timecount);
+#ifdef SERIAL_LOAD
+		account_isr_time(rx_start_bit_timecount);
+#endif
+		return;
+	}
+#endif
 
+	TRACE(TRACE_START_BIT);
 	disable_rx_interrupt();
 
-	if (rx_start_bit_timecount < sample_offset_treshold[serial_config->speed]) {
-		rx_sample_countdown = 2;
+	if (rx_start_bit_timecount < serial_config->rx_threshold) {
+		rx_sample_countdown = rx_start_countdown;
 	} else {
-		rx_sample_countdown = 3;
+		rx_sample_countdown = rx_start_countdown + 1;
 	}
 
 
@@ -332,6 +984,10 @@ ISR(PCINT0_vect)
 		SERIAL_RECEIVED_START_BIT
 	);
 
+#ifdef SERIAL_LOAD
+	account_isr_time(rx_start_bit_timecount);
+#endif
+
 }
 #endif
 
@@ -345,6 +1001,34 @@ ISR(PCINT0_vect)
 ISR(TIM1_COMPA_vect)
 {
 
+#ifdef SERIAL_LOAD
+	uint8_t entry_timecount = TCNT1;
+
+	if (++load_window_ticks == 0) {
+		// Window done: publish and start over
+		load_counts_last = load_counts;
+		load_counts = 0;
+		load_window_valid = 1;
+	}
+#endif
+
+#ifdef SERIAL_TICKS
+	serial_ticks++;
+#endif
+
+#ifdef SERIAL_STATS
+	if (--stats_window_countdown == 0) {
+		stats_last.tx_frames = stats_current.tx_frames;
+		stats_last.rx_frames = stats_current.rx_frames;
+		stats_last.rx_bytes = stats_current.rx_bytes;
+		stats_current.tx_frames = 0;
+		stats_current.rx_frames = 0;
+		stats_current.rx_bytes = 0;
+		stats_window_countdown = stats_window_length;
+		stats_window_valid = 1;
+	}
+#endif
+
 #ifndef TX_ONLY
 	// RX
 	if (connection_state_is(SERIAL_RECEIVED_START_BIT)) {
@@ -355,6 +1039,7 @@ ISR(TIM1_COMPA_vect)
 			// Sample first bit
 			if (bit_is_set(*(serial_config->rx_port), serial_config->rx_pin))
 				rx_byte |= (1 << rx_bit_counter);
+			TRACE(TRACE_SAMPLE | rx_bit_counter << 1 | ((rx_byte >> rx_bit_counter) & 1));
 			rx_bit_counter++;
 			rx_phase = 0;
 			move_connection_state(
@@ -364,25 +1049,80 @@ ISR(TIM1_COMPA_vect)
 
 		} 
 
-	} else if (rx_phase && connection_state_is(SERIAL_RECEIVING_DATA)) {
+	} else if (connection_state_is(SERIAL_RECEIVING_DATA) &&
+			++rx_phase == rx_ticks_per_bit) {
 	
 		rx_phase = 0;
 
 		// Subsequent data bits or stop bit
 		switch (rx_bit_counter) {
 
-			case 8:
+			case DATA_BITS:
 
 				// Stop bit. If received, load data into
 				// the receive buffer. As this library is the only one
 				// with access, and shifting bytes out of the buffer is 
 				// done in the bottom handler of this interrupt, we can
 				// be sure no one else is accessing the buffer
+#ifdef SERIAL_STATS
+				stats_current.rx_frames++;
+#endif
 				if (bit_is_set(*(serial_config->rx_port), serial_config->rx_pin)) {
-					rx_bit_counter = 0;
+					TRACE(TRACE_STOP_BIT_OK);
+#ifdef SERIAL_LIN
+					// The PID goes to lin.c separately, with the number
+					// of bytes stored before it
+					if (lin_state == LIN_PID) {
+						lin_pid = rx_byte;
+						lin_mark = lin_stored;
+						lin_header = 1;
+						lin_state = LIN_IDLE;
+					} else
+#endif
+#ifdef SERIAL_ECHO
+					// Our own echo is dropped, a garbled one is a collision
+					if (echo_pending) {
+						if (rx_byte != echo_byte)
+							echo_collisions++;
+						echo_pending = 0;
+					} else
+#endif
+#ifdef SERIAL_9BIT
+					// Address bytes only select, data bytes are only kept
+					// when we were selected
+					if (rx_address_mark)
+						rx_addressed = (rx_byte == rx_address);
+					else if (rx_addressed)
+#endif
+#ifdef SERIAL_NMEA
+					nmea_store(rx_byte);
+#else
 					store_data(&rx_buffer, rx_byte);
-					rx_byte = 0;
-				} // Do nothing if this is not a stop bit
+#endif
+				} else {
+					// Do nothing if this is not a stop bit
+					TRACE(TRACE_STOP_BIT_BAD);
+#ifdef SERIAL_SNAPSHOT
+					rx_frame_errors++;
+#endif
+#ifdef SERIAL_ECHO
+					if (echo_pending) {
+						echo_collisions++;
+						echo_pending = 0;
+					}
+#endif
+#ifdef SERIAL_LIN
+					// All 0 up to the stop bit: break, sync comes next
+					if (rx_byte == 0) {
+						lin_state = LIN_SYNC;
+						lin_edges = 0;
+					} else {
+						lin_state = LIN_IDLE;
+					}
+#endif
+				}
+				rx_bit_counter = 0;
+				rx_byte = 0;
 				
 				// We're done with this byte, so let's wait for the next one. No rest for the wicked
 				move_connection_state(
@@ -393,115 +1133,164 @@ ISR(TIM1_COMPA_vect)
 
 				break;
 
-			default:
+#ifdef SERIAL_9BIT
+			case 8:
 
-				// Normal data bit
-				if (bit_is_set(*(serial_config->rx_port), serial_config->rx_pin))
-					rx_byte |= (1 << rx_bit_counter);	
+				// Address mark
+				rx_address_mark = bit_is_set(*(serial_config->rx_port), serial_config->rx_pin);
 				rx_bit_counter++;
 
 				break;
-		}
+#endif
 
-	} else {
+			default:
+
+				// Normal data bit
+				if (bit_is_set(*(serial_config->rx_port), serial_config->rx_pin))
+					rx_byte |= (1 << rx_bit_counter);	
+				TRACE(TRACE_SAMPLE | rx_bit_counter << 1 | ((rx_byte >> rx_bit_counter) & 1));
+				rx_bit_counter++;
 
-		rx_phase = 1;
+				break;
+		}
 
 	}  // if connection_state_is(SERIAL_RECEIVED_START_BIT)
 #endif
 	
-	// TX
-	switch(tx_phase) {
-
-		case 0:
-
-			tx_phase = 1;
-			break;
-
-		case 1: 
-
-			tx_phase = 0;
-			if (connection_state_is(SERIAL_SENT_START_BIT)) {
+#ifndef RX_ONLY
+	// TX: one step per bit time, every tx_ticks_per_bit ticks
+	if (++tx_phase == tx_ticks_per_bit) {
 
-				// Write first bit of data
-				send_data_bit(tx_bit_counter++);
-				move_connection_state(
-					SERIAL_SENT_START_BIT,
-					SERIAL_SENDING_DATA 
-				);
+		tx_phase = 0;
+		if (connection_state_is(SERIAL_SENT_START_BIT)) {
 
-			} else if (connection_state_is(SERIAL_SENDING_DATA)) {
+			// Write first bit of data
+			send_data_bit(tx_bit_counter++);
+			move_connection_state(
+				SERIAL_SENT_START_BIT,
+				SERIAL_SENDING_DATA 
+			);
 
-				// Data or stop bit
-				if (tx_bit_counter == 8) {
+		} else if (connection_state_is(SERIAL_SENDING_DATA)) {
 
-					// Stop bit
-					*(serial_config->tx_port) |=(1 << serial_config->tx_pin);
+			// Data or stop bit. In 9 bit mode, the 9th is 0: we only
+			// send data bytes
+			if (tx_bit_counter == DATA_BITS) {
 
-					// Try to shift out the sent byte
-					if (shift_buffer_down(&tx_buffer) == SERIAL_OK) {
-						move_connection_state(
-							SERIAL_SENDING_DATA,
-							SERIAL_IDLE
-						);
-					} else {
-						// Drat. Try again later
-						move_connection_state(
-							SERIAL_SENDING_DATA,
-							SERIAL_TX_BUFFER_LOCKED
-						);
-					}
+				// Stop bit
+				*(serial_config->tx_port) |=(1 << serial_config->tx_pin);
+#ifdef SERIAL_STATS
+				stats_current.tx_frames++;
+#endif
 
+				// Try to shift out the sent byte
+				if (shift_buffer_down(&tx_buffer, 1) == SERIAL_OK) {
+					move_connection_state(
+						SERIAL_SENDING_DATA,
+						SERIAL_IDLE
+					);
 				} else {
+					// Drat. Try again later
+					TRACE(TRACE_TX_LOCK_RETRY);
+					move_connection_state(
+						SERIAL_SENDING_DATA,
+						SERIAL_TX_BUFFER_LOCKED
+					);
+				}
 
-					// Data bit
-					send_data_bit(tx_bit_counter++);
+			} else {
 
-				}
+				// Data bit
+				send_data_bit(tx_bit_counter++);
 
-			} else if (connection_state_is(SERIAL_TX_BUFFER_LOCKED)) {
+			}
 
-				// Keep trying to shift TX buffer
-				if (shift_buffer_down(&tx_buffer) == SERIAL_OK) {
-					move_connection_state(
-						SERIAL_SENDING_DATA,
-						SERIAL_IDLE
-					);
-				}	
+		} else if (connection_state_is(SERIAL_TX_BUFFER_LOCKED)) {
 
+			// Keep trying to shift TX buffer
+			if (shift_buffer_down(&tx_buffer, 1) == SERIAL_OK) {
+				move_connection_state(
+					SERIAL_TX_BUFFER_LOCKED,
+					SERIAL_IDLE
+				);
 			} else {
+				TRACE(TRACE_TX_LOCK_RETRY);
+			}
 
-				// Not sending anything. Check for byte to send. Not using dirty
-				// flag as top != 0 means the same thing for TX buffer
-				if (tx_buffer.top) {
+		} else {
 
-					// New data
-					*(serial_config->tx_port) &= ~(1 << serial_config->tx_pin);  // Start bit
-					tx_byte = tx_buffer.data[0];
-					tx_bit_counter = 0;
-					move_connection_state(
-						SERIAL_IDLE,
-						SERIAL_SENT_START_BIT
-					);
+			// Not sending anything. Check for byte to send. Not using dirty
+			// flag as top != 0 means the same thing for TX buffer
+			if (tx_buffer.top) {
+
+				// New data. The driver has to be on before the start bit
+#ifdef SERIAL_RS485
+				*(serial_config->de_port) |= (1 << serial_config->de_pin);
+#endif
+				*(serial_config->tx_port) &= ~(1 << serial_config->tx_pin);  // Start bit
+				tx_byte = tx_buffer.data[0];
+				tx_bit_counter = 0;
+				tx_active = 1;
+#ifdef SERIAL_ECHO
+				// Expect the echo if listening. If someone else's frame is
+				// already coming in, that is what gets compared, and it
+				// will not match
+				if (echo_pending)
+					echo_collisions++;	// Previous echo never came back
+				echo_byte = tx_byte;
+				echo_pending = (GIMSK & (1 << PCIE)) ||
+					connection_state_is(SERIAL_RECEIVED_START_BIT | SERIAL_RECEIVING_DATA);
+#endif
+				move_connection_state(
+					SERIAL_IDLE,
+					SERIAL_SENT_START_BIT
+				);
 
+			} else if (tx_active) {
+
+				// Nothing more to send and the last stop bit has had its
+				// full bit time: release the bus
+#ifdef SERIAL_RS485
+				*(serial_config->de_port) &= ~(1 << serial_config->de_pin);
+#endif
+				tx_active = 0;
+#ifdef SERIAL_ECHO
+				if (echo_pending) {
+					echo_collisions++;
+					echo_pending = 0;
 				}
+#endif
 
 			}
 
-			break; // tx_phase 1
+		}
 
-	} // switch(tx_phase)
+	} // if (++tx_phase == tx_ticks_per_bit)
+#endif
 
 	// Bottom handler: RX buffer 
 	if (rx_buffer.dirty) {
 
-		shift_buffer_down(&rx_buffer);
+		// dirty is the number of bytes read: one from serial_get_char,
+		// more from serial_drop_data. Never more than there is
+		if (rx_buffer.dirty > rx_buffer.top)
+			rx_buffer.dirty = rx_buffer.top;
+		shift_rx_buffer(rx_buffer.dirty);
+#ifdef SERIAL_NMEA
+		nmea_committed = nmea_committed > rx_buffer.dirty ? nmea_committed - rx_buffer.dirty : 0;
+		nmea_start = nmea_start > rx_buffer.dirty ? nmea_start - rx_buffer.dirty : 0;
+#endif
 		rx_buffer.dirty = 0;
 
 	}
 
+#ifdef SERIAL_LOAD
+	account_isr_time(entry_timecount);
+#endif
+
 }
 
+#ifndef RX_ONLY
 /************************************************************************
  * acquire_buffer_lock		Buffer locking functions
  * release_buffer_lock
@@ -535,6 +1324,301 @@ static void release_buffer_lock(volatile struct buffer *buffer)
 	// unlocking a buffer that should stay locked
 	buffer->lock = 0;
 
+}
+#endif
+
+/************************************************************************
+ * release_resources: undo (a possibly partial) serial_initialise
+ *
+ * Stops the timer, masks our interrupts, releases the pins to inputs
+ * without pullup, frees all memory and resets the state variables, so
+ * that serial_initialise can run again. The caller makes sure no frame
+ * is in flight.
+ ************************************************************************/
+
+static void release_resources(void)
+{
+
+	// serial_initialise error paths run before the caller's sei(), so
+	// leave the interrupt flag as it was
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+
+		// Stop timer, drop CTC mode and any pending compare match
+		TCCR1 &= ~(1 << CTC1 | 1 << CS13 | 1 << CS12 | 1 << CS11 | 1 << CS10);
+		TIMSK &= ~(1 << OCIE1A);
+		TIFR = (1 << OCF1A);
+
+		if (serial_config != NULL) {
+
+			if (serial_config->rx_pin != PIN_INVALID) {
+				PCMSK &= ~(1 << serial_config->rx_pin);
+				// Leave the pin change interrupt to others still using it
+				if (!PCMSK)
+					GIMSK &= ~(1 << PCIE);
+			}
+
+			if (serial_config->tx_pin != PIN_INVALID) {
+				DDRB &= ~(1 << serial_config->tx_pin);
+				PORTB &= ~(1 << serial_config->tx_pin);
+			}
+
+#ifdef SERIAL_RS485
+			if (serial_config->de_pin != PIN_INVALID) {
+				DDRB &= ~(1 << serial_config->de_pin);
+				PORTB &= ~(1 << serial_config->de_pin);
+			}
+#endif
+
+			free(serial_config);
+			serial_config = NULL;
+
+		}
+
+		connection_state = SERIAL_NOT_INITIALISED;
+
+	}
+
+	free(rx_buffer.data);
+	rx_buffer.data = NULL;
+	rx_buffer.top = rx_buffer.dirty = rx_buffer.lock = 0;
+	rx_bit_counter = 0;
+
+#ifndef RX_ONLY
+	free(tx_buffer.data);
+	tx_buffer.data = NULL;
+	tx_buffer.top = tx_buffer.dirty = tx_buffer.lock = 0;
+	tx_bit_counter = tx_phase = tx_active = 0;
+#endif
+
+#ifndef TX_ONLY
+	rx_byte = rx_phase = rx_sample_countdown = 0;
+#ifdef SERIAL_9BIT
+	rx_addressed = 0;
+#endif
+#endif
+
+#ifdef SERIAL_LIN
+	lin_state = lin_header = lin_stored = 0;
+#endif
+
+#ifdef SERIAL_NMEA
+	nmea_state = NMEA_IDLE;
+	nmea_start = nmea_committed = 0;
+#endif
+
+#ifdef RX_TIMESTAMPS
+	free(rx_timestamps);
+	rx_timestamps = NULL;
+#endif
+
+#ifdef SERIAL_LOAD
+	load_counts = load_window_ticks = load_window_valid = 0;
+#endif
+
+#ifdef SERIAL_STATS
+	stats_current.tx_frames = stats_current.rx_frames = stats_current.rx_bytes = 0;
+	stats_window_valid = 0;
+#endif
+
+#ifdef SERIAL_TRACE
+	trace_count = 0;
+#endif
+
+#ifdef SERIAL_ECHO
+	echo_pending = echo_collisions = 0;
+#endif
+
+}
+
+/************************************************************************
+ * program_timer: set the timer period and prescaler
+ *
+ * Parameters:
+ *		uint8_t ocr				Compare value, the tick is ocr + 1 counts
+ *		uint8_t clock_select	CS1[3:0] bits for the prescaler
+ *		uint16_t window			Statistics window for the speed, in ticks
+ *
+ * The prescaler only goes to TCCR1 if the timer is running, otherwise
+ * serial_initialise starts it with clock_select. Restarts the statistics
+ * window, as its length changes along, and scales the ISR load allowance
+ * to the new timer counts, rounded.
+ ************************************************************************/
+
+static void program_timer(uint8_t ocr, uint8_t clock_select, uint16_t window)
+{
+
+	OCR1A = OCR1C = ocr;
+	TCNT1 = 0;
+#ifdef SERIAL_LIN
+	serial_config->nominal_ocr = ocr;
+#endif
+
+	serial_config->clock_select = clock_select;
+#ifdef SERIAL_LOAD
+	serial_config->load_overhead = (LOAD_ISR_OVERHEAD_CYCLES +
+		(1 << (clock_select - 1)) / 2) >> (clock_select - 1);
+#endif
+	if (TCCR1 & 0x0f)
+		TCCR1 = (TCCR1 & ~(1 << CS13 | 1 << CS12 | 1 << CS11 | 1 << CS10)) | clock_select;
+
+#ifdef SERIAL_STATS
+	stats_window_length = stats_window_countdown = window;
+	stats_current.tx_frames = 0;
+	stats_current.rx_frames = 0;
+	stats_current.rx_bytes = 0;
+#else
+	(void)window;
+#endif
+
+}
+
+/************************************************************************
+ * set_timing: program the timer and tick dividers for RX and TX speeds
+ *
+ * Parameters:
+ *		serial_speed_t rx_speed		Receive speed
+ *		serial_speed_t tx_speed		Transmit speed
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if a speed is out of range or the faster speed is not
+ *		a whole multiple of the slower one
+ *
+ * The timer runs at twice the faster speed, the slower direction acts
+ * every so many ticks. Both directions thus share the timing error of
+ * the faster speed's OCR value. Call with the timer stopped or with
+ * interrupts disabled and no frame in flight.
+ ************************************************************************/
+
+static return_code_t set_timing(serial_speed_t rx_speed, serial_speed_t tx_speed)
+{
+
+	serial_speed_t base;
+
+	if (rx_speed >= NUM_SPEED || tx_speed >= NUM_SPEED)
+		return SERIAL_ERROR;
+
+	// A direction that is not built in does not constrain the timer
+#ifdef TX_ONLY
+	rx_speed = tx_speed;
+#endif
+#ifdef RX_ONLY
+	tx_speed = rx_speed;
+#endif
+
+	base = speed_units[rx_speed] > speed_units[tx_speed] ? rx_speed : tx_speed;
+	if (speed_units[base] % speed_units[rx_speed] ||
+		speed_units[base] % speed_units[tx_speed])
+		return SERIAL_ERROR;
+
+	// /8 prescaler - datasheet p.89 table 12-5
+#ifdef SERIAL_STATS
+	program_timer(timer_ocr_values[base], 1 << CS12, stats_window_ticks[base]);
+#else
+	program_timer(timer_ocr_values[base], 1 << CS12, 0);
+#endif
+	serial_config->speed = base;
+	serial_config->baud = 2400UL * speed_units[base];
+
+#ifndef TX_ONLY
+	serial_config->rx_threshold = sample_offset_treshold[base];
+	rx_ticks_per_bit = 2 * (speed_units[base] / speed_units[rx_speed]);
+	rx_start_countdown = rx_ticks_per_bit + rx_ticks_per_bit / 2 - 1;
+	rx_phase = 0;
+#endif
+
+#ifndef RX_ONLY
+	tx_ticks_per_bit = 2 * (speed_units[base] / speed_units[tx_speed]);
+	tx_phase = 0;
+#endif
+
+	return SERIAL_OK;
+
+}
+
+/************************************************************************
+ * baud_timing: work out the timer setting for a speed in baud
+ *
+ * Parameters:
+ *		uint32_t baud			The speed
+ *		uint8_t *ocr			Where to store the compare value
+ *		uint8_t *clock_select	Where to store the CS1[3:0] bits
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if the speed is below MIN_BAUD, a tick would be
+ *		shorter than MIN_TICK_CYCLES, or the nearest speed the timer can
+ *		do is off by more than SERIAL_BAUD_TOLERANCE
+ *
+ * Takes the smallest prescaler that gets a tick into the 8 bit counter,
+ * which gives the best resolution. The same sums are done at compile
+ * time for SERIAL_BAUD.
+ ************************************************************************/
+
+static return_code_t baud_timing(uint32_t baud, uint8_t *ocr, uint8_t *clock_select)
+{
+
+	uint32_t counts = 0;
+	uint32_t actual, error;
+	uint8_t cs;
+
+	if (baud < MIN_BAUD || baud > 4UL * 0xffff || F_CPU / (2 * baud) < MIN_TICK_CYCLES)
+		return SERIAL_ERROR;
+
+	// CS1[3:0] = n selects CK / 2^(n - 1)
+	for (cs = 1; cs <= 15; cs++) {
+		counts = (F_CPU + (baud << (cs - 1))) / (2 * baud << (cs - 1));
+		if (counts <= 256)
+			break;
+	}
+	if (cs > 15)
+		return SERIAL_ERROR;
+
+	actual = F_CPU / (2 * counts << (cs - 1));
+	error = actual > baud ? actual - baud : baud - actual;
+	if (error * 1000 > (uint32_t)SERIAL_BAUD_TOLERANCE * baud)
+		return SERIAL_ERROR;
+
+	*ocr = counts - 1;
+	*clock_select = cs;
+
+	return SERIAL_OK;
+
+}
+
+/************************************************************************
+ * set_baud_timing: program the timer for a speed in baud
+ *
+ * Parameters:
+ *		uint32_t baud			The speed, for both directions
+ *		uint8_t ocr				Compare value from baud_timing
+ *		uint8_t clock_select	CS1[3:0] bits from baud_timing
+ *
+ * As set_timing, with the same calling conditions. The sample offset
+ * treshold is half a tick plus the PCINT0_vect latency in timer counts.
+ ************************************************************************/
+
+static void set_baud_timing(uint32_t baud, uint8_t ocr, uint8_t clock_select)
+{
+
+	// Window is 1/8 s, so baud / 4 ticks: at least one bit, as baud_timing
+	// keeps to MIN_BAUD
+	program_timer(ocr, clock_select, baud / 4);
+	serial_config->speed = SPEED_CUSTOM;
+	serial_config->baud = baud;
+
+#ifndef TX_ONLY
+	serial_config->rx_threshold = sample_threshold(ocr, clock_select);
+	rx_ticks_per_bit = 2;
+	rx_start_countdown = 2;
+	rx_phase = 0;
+#endif
+
+#ifndef RX_ONLY
+	tx_ticks_per_bit = 2;
+	tx_phase = 0;
+#endif
+
 }
 
 /************************************************************************
@@ -568,40 +1652,91 @@ extern return_code_t serial_initialise(struct serial_init *serial_init)
 
 
 	uint8_t *rxd;
+#ifndef RX_ONLY
 	uint8_t *txd;
+#endif
+#ifndef SERIAL_BAUD
+	uint8_t ocr, clock_select;
+#endif
 
 
 	// Sanity checks. Timer running?
 	if (TCCR1 & 0x0f)
 		return SERIAL_ERROR;
 
-	// Allocate buffers
+	// Allocate buffers. From here on, errors have to give back
+	// whatever was set up so far
 	if ((rxd = malloc(RX_BUFFER_SIZE)) == NULL)
 		return SERIAL_ERROR;
 
-	if ((txd = malloc(TX_BUFFER_SIZE)) == NULL)
+	rx_buffer.data = rxd;
+
+#ifndef RX_ONLY
+	if ((txd = malloc(TX_BUFFER_SIZE)) == NULL) {
+		release_resources();
 		return SERIAL_ERROR;
+	}
 
-	rx_buffer.data = rxd;
 	tx_buffer.data = txd;
+#endif
+
+#ifdef RX_TIMESTAMPS
+	if ((rx_timestamps = malloc(RX_BUFFER_SIZE * sizeof(uint16_t))) == NULL) {
+		release_resources();
+		return SERIAL_ERROR;
+	}
+#endif
 
 	// Setup I/O
 
-	if ((serial_config = malloc(sizeof(struct serial_config_t))) == NULL)
+	if ((serial_config = malloc(sizeof(struct serial_config_t))) == NULL) {
+		release_resources();
 		return SERIAL_ERROR;
+	}
 
 	serial_config->tx_pin = PIN_INVALID;
 	serial_config->rx_pin = PIN_INVALID;
+#ifdef SERIAL_RS485
+	serial_config->de_pin = PIN_INVALID;
+#endif
+
+#ifndef RX_ONLY
+	if (setup_io(serial_init->tx_pin, SERIAL_DIR_TX) != SERIAL_OK) {
+		release_resources();
+		return SERIAL_ERROR;
+	}
+#endif
 
-	if (setup_io(serial_init->tx_pin, SERIAL_DIR_TX) != SERIAL_OK)
+#ifdef SERIAL_RS485
+	// The ISR does not check for a missing DE pin, so insist on one
+	if (serial_init->de_pin == NULL ||
+		setup_io(serial_init->de_pin, SERIAL_DIR_DE) != SERIAL_OK) {
+		release_resources();
 		return SERIAL_ERROR;
+	}
+#endif
 
-#ifndef TX_ONLY
-	if (setup_io(serial_init->rx_pin, SERIAL_DIR_RX) != SERIAL_OK)
+	// Timer compare values and dividers for the speed setting
+#ifdef SERIAL_BAUD
+	set_baud_timing(SERIAL_BAUD, BAUD_OCR, BAUD_CLOCK_SELECT);
+#else
+	if (serial_init->baud) {
+		if (baud_timing(serial_init->baud, &ocr, &clock_select) != SERIAL_OK) {
+			release_resources();
+			return SERIAL_ERROR;
+		}
+		set_baud_timing(serial_init->baud, ocr, clock_select);
+	} else if (set_timing(serial_init->speed, serial_init->speed) != SERIAL_OK) {
+		release_resources();
 		return SERIAL_ERROR;
+	}
+#endif
 
-	// Squirrel away speed setting
-	serial_config->speed = serial_init->speed;
+#ifndef TX_ONLY
+	if (setup_io(serial_init->rx_pin, SERIAL_DIR_RX) != SERIAL_OK) {
+		release_resources();
+		return SERIAL_ERROR;
+	}
 
 	// Setup interrupt: frame receive: pin change interrupt on RX pin
 	if (serial_config->rx_pin != PIN_INVALID)
@@ -614,11 +1749,10 @@ extern return_code_t serial_initialise(struct serial_init *serial_init)
 	// Setup timer
 	// CTC Mode (clear on reaching OCR1C)
 	TCCR1 |= (1 << CTC1); 
-	OCR1A = OCR1C = timer_ocr_values[serial_init->speed];
 
-	// Start timer. /8 prescaler - datasheet p.89 table 12-5
+	// Start timer with the prescaler picked for the speed
 	TCCR1 &= ~(1 << CS13 | 1 << CS12 | 1 << CS11 | 1 << CS10);
-	TCCR1 |= (1 << CS12);
+	TCCR1 |= serial_config->clock_select;
 
 	connection_state = SERIAL_IDLE;
 
@@ -627,65 +1761,686 @@ extern return_code_t serial_initialise(struct serial_init *serial_init)
 }
 
 /************************************************************************
- * serial_put_char: send a single byte
+ * serial_deinitialise: tear down connection
  *
- * Parameters:
- *		uint8_t data		Byte to send
+ * Parameters: none
  *
  * Returns:
  *		SERIAL_OK on success
- *		SERIAL_ERROR on failure
+ *		SERIAL_ERROR if not initialised
  *
- *
- * Please not that this function blocks on lock. However, having a TX
- * buffer locked here should not normally happen, as the interrupt that
- * could lock it does not return unless it is unlocked again.
+ * Waits for the TX buffer to drain and the last stop bit to complete,
+ * so interrupts must be enabled. A frame being received is dropped.
+ * Afterwards the timer is stopped, our interrupts are masked, the pins
+ * are inputs without pullup and all memory is freed, so
+ * serial_initialise can be called again, with different settings.
  ************************************************************************/
 
-extern return_code_t serial_put_char(uint8_t data)
+extern return_code_t serial_deinitialise()
 {
 
-	return_code_t retval = SERIAL_ERROR;
+	if (connection_state_is(SERIAL_NOT_INITIALISED))
+		return SERIAL_ERROR;
 
-	acquire_buffer_lock(&tx_buffer);
-	if (tx_buffer.top < TX_BUFFER_SIZE) {
-		tx_buffer.data[(tx_buffer.top)++] = data;
-		retval = SERIAL_OK;
-	}
-	release_buffer_lock(&tx_buffer);
+#ifndef RX_ONLY
+	// Drain TX buffer, up to the end of the last stop bit
+	while (!serial_tx_complete());
+#endif
 
-	return retval;
+	release_resources();
+
+	return SERIAL_OK;
 
 }
 
 /************************************************************************
- * serial_send_data: Send multiple byte serial data
+ * wait_for_idle: wait until no frame is being sent or received
  *
- * Parameters:
- *		char *data	The data to be sent
+ * Returns with interrupts disabled, so it stays that way. The caller
+ * enables them again.
  *
- * Returns:
- *		Number of bytes sent out. This could be less than length, as the
- *		buffer might be full or some other error might have occured
+ * TX is back to SERIAL_IDLE as soon as the stop bit starts, so that is
+ * not enough: tx_active only drops once the stop bit has had its full
+ * bit time and the TX buffer is empty. Otherwise the last stop bit would
+ * be cut short by the new timing.
  ************************************************************************/
 
-extern uint16_t serial_send_data(char *data)
+static void wait_for_idle(void)
 {
 
-	uint16_t data_length = strlen(data);
-	uint16_t i;
-
+	// Spin until idle, leaving interrupts off once we get there
+	while (1) {
+		cli();
+		if (!connection_state_is(
+				SERIAL_TRANSMITTING |
+				SERIAL_RECEIVED_START_BIT |
+				SERIAL_RECEIVING_DATA)
+#ifndef RX_ONLY
+			&& !tx_active
+#endif
+			)
+			break;
+		sei();
+	}
 
-	for (i = 0; i < data_length; i++) {
+}
+
+/************************************************************************
+ * serial_set_speed(s), serial_set_baud: change speed on a running
+ * connection
+ *
+ * Parameters:
+ *		serial_speed_t speed		The new speed for both directions
+ * or
+ *		serial_speed_t rx_speed		The new receive speed
+ *		serial_speed_t tx_speed		The new transmit speed
+ * or
+ *		uint32_t baud				The new speed in baud, both directions
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if not initialised or the speeds are not possible
+ *
+ * Waits until no frame is being received and everything in the TX
+ * buffer has gone out, up to the end of the last stop bit, at the old
+ * speed. Then reprograms the timer with interrupts disabled, so the ISRs
+ * never see a half switched configuration.
+ * A start bit arriving while interrupts are off is sampled at the new
+ * speed, so the peer should be quiet while switching.
+ ************************************************************************/
+
+extern return_code_t serial_set_speed(serial_speed_t speed)
+{
+
+	return serial_set_speeds(speed, speed);
+
+}
+
+extern return_code_t serial_set_speeds(serial_speed_t rx_speed, serial_speed_t tx_speed)
+{
+
+	return_code_t retval;
+
+	if (connection_state_is(SERIAL_NOT_INITIALISED))
+		return SERIAL_ERROR;
+
+	wait_for_idle();
+	retval = set_timing(rx_speed, tx_speed);
+	sei();
+
+	return retval;
+
+}
+
+extern return_code_t serial_set_baud(uint32_t baud)
+{
+
+	uint8_t ocr, clock_select;
+
+	if (connection_state_is(SERIAL_NOT_INITIALISED))
+		return SERIAL_ERROR;
+
+	// The division is slow, so do it before holding up the ISRs
+	if (baud_timing(baud, &ocr, &clock_select) != SERIAL_OK)
+		return SERIAL_ERROR;
+
+	wait_for_idle();
+	set_baud_timing(baud, ocr, clock_select);
+	sei();
+
+	return SERIAL_OK;
+
+}
+
+#ifndef RX_ONLY
+/************************************************************************
+ * serial_put_char: send a single byte
+ *
+ * Parameters:
+ *		uint8_t data		Byte to send
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR on failure
+ *
+ *
+ * Please not that this function blocks on lock. However, having a TX
+ * buffer locked here should not normally happen, as the interrupt that
+ * could lock it does not return unless it is unlocked again.
+ ************************************************************************/
+
+extern return_code_t serial_put_char(uint8_t data)
+{
+
+	return_code_t retval = SERIAL_ERROR;
+
+	acquire_buffer_lock(&tx_buffer);
+	if (tx_buffer.top < TX_BUFFER_SIZE) {
+		tx_buffer.data[(tx_buffer.top)++] = data;
+		retval = SERIAL_OK;
+	}
+	release_buffer_lock(&tx_buffer);
+
+	return retval;
+
+}
+
+/************************************************************************
+ * serial_tx_complete: check whether everything has been sent
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		1 if the TX buffer is empty and the last stop bit has ended
+ *		0 otherwise
+ *
+ * tx_active is only cleared by the ISR once the stop bit has had its
+ * full bit time, which is also when the RS-485 driver is released.
+ ************************************************************************/
+
+extern uint8_t serial_tx_complete()
+{
+
+	return !tx_buffer.top && !tx_active;
+
+}
+
+/************************************************************************
+ * serial_reserve_data: get the free part of the TX buffer to write into
+ *
+ * Parameters:
+ *		uint16_t *room	Where to store the number of free bytes
+ *
+ * Returns:
+ *		uint8_t *data	Start of the free part
+ *
+ * The lock keeps the ISR from shifting the buffer under the writer. It
+ * can still start the byte at the front, which is below top.
+ ************************************************************************/
+
+extern uint8_t *serial_reserve_data(uint16_t *room)
+{
+
+	acquire_buffer_lock(&tx_buffer);
+	*room = TX_BUFFER_SIZE - tx_buffer.top;
+
+	return tx_buffer.data + tx_buffer.top;
+
+}
+
+/************************************************************************
+ * serial_commit_data: queue bytes written after serial_reserve_data
+ *
+ * Parameters:
+ *		uint16_t length	Number of bytes written
+ *
+ * Returns: nothing
+ ************************************************************************/
+
+extern void serial_commit_data(uint16_t length)
+{
+
+	if (length > TX_BUFFER_SIZE - tx_buffer.top)
+		length = TX_BUFFER_SIZE - tx_buffer.top;
+
+	tx_buffer.top += length;
+	release_buffer_lock(&tx_buffer);
+
+}
+
+/************************************************************************
+ * serial_send_data: Send multiple byte serial data
+ *
+ * Parameters:
+ *		char *data	The data to be sent
+ *
+ * Returns:
+ *		Number of bytes sent out. This could be less than length, as the
+ *		buffer might be full or some other error might have occured
+ ************************************************************************/
+
+extern uint16_t serial_send_data(char *data)
+{
+
+	uint16_t data_length = strlen(data);
+	uint16_t i;
+
+
+	for (i = 0; i < data_length; i++) {
 
 		if (serial_put_char(data[i]) == SERIAL_ERROR) 
 			break;
 
 	}
 
-	return i;
+	return i;
+
+}
+#endif
+
+#ifdef SERIAL_TICKS
+/************************************************************************
+ * serial_get_ticks: get the current Timer1 tick count
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		uint16_t ticks	Number of Timer1 compare matches since
+ *						initialisation (two per bit time)
+ ************************************************************************/
+
+extern uint16_t serial_get_ticks()
+{
+
+	uint16_t ticks;
+
+	// 16 bit read, so make sure the ISR does not update it halfway
+	cli();
+	ticks = serial_ticks;
+	sei();
+
+	return ticks;
+
+}
+
+/************************************************************************
+ * serial_get_tick_rate: get the Timer1 tick rate
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		uint32_t rate	Ticks per second, or 0 if not initialised
+ ************************************************************************/
+
+extern uint32_t serial_get_tick_rate()
+{
+
+	if (serial_config == NULL)
+		return 0;
+
+	return 2 * serial_config->baud;
+
+}
+
+#ifndef TX_ONLY
+/************************************************************************
+ * serial_get_rx_bit_ticks: get the length of a received bit
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		uint8_t ticks	Timer1 ticks per received bit
+ ************************************************************************/
+
+extern uint8_t serial_get_rx_bit_ticks()
+{
+
+	return rx_ticks_per_bit;
+
+}
+#endif
+#endif
+
+#ifdef SERIAL_LOAD
+/************************************************************************
+ * serial_get_load: CPU share taken by the library's interrupts
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		uint8_t	load	Percentage of CPU time spent in the ISRs over the
+ *						last window of 256 timer ticks (128 bit times),
+ *						or 0 if no window has completed yet
+ ************************************************************************/
+
+static uint8_t load_percentage(uint32_t counts)
+{
+
+	// Window length in timer counts is 256 ticks of OCR1C + 1 counts
+	uint32_t window = 256UL * ((uint16_t)OCR1C + 1);
+
+	// ISRs that overrun their ticks count past the window
+	if (counts >= window)
+		return 100;
+
+	return counts * 100 / window;
+
+}
+
+extern uint8_t serial_get_load()
+{
+
+	uint32_t counts;
+
+	if (!load_window_valid)
+		return 0;
+
+	cli();
+	counts = load_counts_last;
+	sei();
+
+	return load_percentage(counts);
+
+}
+#endif
+
+#ifdef SERIAL_STATS
+/************************************************************************
+ * serial_get_stats: link utilisation and throughput
+ *
+ * Parameters:
+ *		struct serial_stats *stats	Where to store the figures
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if no window has completed yet
+ *
+ * The window is 1/8 s, so slots available are baud / 8 and byte counts
+ * times 8 give bytes per second.
+ ************************************************************************/
+
+static void stats_from_counters(struct stats_counters *last, struct serial_stats *stats)
+{
+
+	uint16_t window = stats_window_length;
+
+	// Bit slots in a window: its ticks over ticks per bit. Each frame is
+	// FRAME_BITS slots
+#ifndef RX_ONLY
+	stats->tx_utilisation = (uint32_t)last->tx_frames * FRAME_BITS * 100 /
+		(window / tx_ticks_per_bit);
+#else
+	stats->tx_utilisation = 0;
+#endif
+#ifndef TX_ONLY
+	stats->rx_utilisation = (uint32_t)last->rx_frames * FRAME_BITS * 100 /
+		(window / rx_ticks_per_bit);
+#else
+	stats->rx_utilisation = 0;
+#endif
+	stats->tx_bytes_per_second = last->tx_frames * 8;
+	stats->rx_bytes_per_second = last->rx_bytes * 8;
+
+}
+
+extern return_code_t serial_get_stats(struct serial_stats *stats)
+{
+
+	struct stats_counters last;
+
+	if (!stats_window_valid)
+		return SERIAL_ERROR;
+
+	cli();
+	last.tx_frames = stats_last.tx_frames;
+	last.rx_frames = stats_last.rx_frames;
+	last.rx_bytes = stats_last.rx_bytes;
+	sei();
+
+	stats_from_counters(&last, stats);
+
+	return SERIAL_OK;
+
+}
+#endif
+
+#ifdef SERIAL_ECHO
+/************************************************************************
+ * serial_get_collisions: count of bytes that did not echo back intact
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		uint16_t collisions	Echoes that were garbled, missing, or clashed
+ *							with a frame from someone else, since
+ *							initialisation. Wraps around.
+ ************************************************************************/
+
+extern uint16_t serial_get_collisions()
+{
+
+	uint16_t collisions;
+
+	cli();
+	collisions = echo_collisions;
+	sei();
+
+	return collisions;
+
+}
+#endif
+
+#if defined(SERIAL_TRACE) || defined(SERIAL_SNAPSHOT)
+/************************************************************************
+ * put_char_blocking: serial_put_char, waiting for room in the TX buffer
+ ************************************************************************/
+
+static void put_char_blocking(uint8_t data)
+{
+
+	while (serial_put_char(data) == SERIAL_ERROR);
+
+}
+#endif
+
+#ifdef SERIAL_SNAPSHOT
+/************************************************************************
+ * snapshot_put_*: emit snapshot fields, keeping a running checksum
+ *
+ * Multi byte binary fields are little endian. Decimal output skips
+ * leading zeroes.
+ ************************************************************************/
+
+static uint8_t snapshot_checksum;
+
+static void snapshot_put_byte(uint8_t data)
+{
+
+	snapshot_checksum ^= data;
+	put_char_blocking(data);
+
+}
+
+static void snapshot_put_word(uint16_t data)
+{
+
+	snapshot_put_byte(data);
+	snapshot_put_byte(data >> 8);
+
+}
+
+static void snapshot_put_decimal(char *key, uint32_t data)
+{
+
+	char digits[10];
+	uint8_t i = 0;
+
+	put_char_blocking(' ');
+	while (*key)
+		put_char_blocking(*key++);
+	put_char_blocking('=');
+
+	do {
+		digits[i++] = '0' + data % 10;
+		data /= 10;
+	} while (data);
+
+	while (i)
+		put_char_blocking(digits[--i]);
+
+}
+
+/************************************************************************
+ * serial_send_snapshot: send all counters and configuration
+ *
+ * Parameters:
+ *		serial_snapshot_format_t format	Binary frame or text line
+ *
+ * Returns: nothing
+ *
+ * Everything is copied with interrupts disabled first, so the snapshot
+ * is consistent, and sent afterwards. Fields of features that are not
+ * built in are sent as 0; the features byte says which are valid.
+ ************************************************************************/
+
+extern void serial_send_snapshot(serial_snapshot_format_t format)
+{
+
+	uint8_t features = 0;
+	uint8_t state;
+	uint16_t rx_pending;
+	uint16_t tx_pending;
+	uint16_t overflows = 0;
+	uint16_t frame_errors = 0;
+	uint16_t ticks = 0;
+	uint8_t load = 0;
+	struct serial_stats stats = {0, 0, 0, 0};
+
+#ifdef SERIAL_LOAD
+	uint32_t counts = 0;
+#endif
+#ifdef SERIAL_STATS
+	struct stats_counters last = {0, 0, 0};
+#endif
+
+#ifdef TX_ONLY
+	features |= SNAPSHOT_FEATURE_TX_ONLY;
+#endif
+#ifdef RX_TIMESTAMPS
+	features |= SNAPSHOT_FEATURE_TIMESTAMPS;
+#endif
+#ifdef SERIAL_TRACE
+	features |= SNAPSHOT_FEATURE_TRACE;
+#endif
+
+	cli();
+	state = connection_state;
+	rx_pending = RX_PENDING;
+	tx_pending = tx_buffer.top;
+	overflows = rx_overflows;
+	frame_errors = rx_frame_errors;
+#ifdef SERIAL_TICKS
+	ticks = serial_ticks;
+#endif
+#ifdef SERIAL_LOAD
+	if (load_window_valid) {
+		counts = load_counts_last;
+		features |= SNAPSHOT_FEATURE_LOAD;
+	}
+#endif
+#ifdef SERIAL_STATS
+	if (stats_window_valid) {
+		last.tx_frames = stats_last.tx_frames;
+		last.rx_frames = stats_last.rx_frames;
+		last.rx_bytes = stats_last.rx_bytes;
+		features |= SNAPSHOT_FEATURE_STATS;
+	}
+#endif
+	sei();
+
+#ifdef SERIAL_LOAD
+	load = load_percentage(counts);
+#endif
+#ifdef SERIAL_STATS
+	stats_from_counters(&last, &stats);
+#endif
+
+	if (format == SERIAL_SNAPSHOT_TEXT) {
+
+		put_char_blocking('S');
+		put_char_blocking('N');
+		snapshot_put_decimal("v", SNAPSHOT_VERSION);
+		snapshot_put_decimal("features", features);
+		snapshot_put_decimal("speed", serial_config->speed);
+		snapshot_put_decimal("baud", serial_config->baud);
+		snapshot_put_decimal("rxsize", RX_BUFFER_SIZE);
+		snapshot_put_decimal("txsize", TX_BUFFER_SIZE);
+		snapshot_put_decimal("state", state);
+		snapshot_put_decimal("rxpending", rx_pending);
+		snapshot_put_decimal("txpending", tx_pending);
+		snapshot_put_decimal("overflows", overflows);
+		snapshot_put_decimal("frameerrors", frame_errors);
+		snapshot_put_decimal("ticks", ticks);
+		snapshot_put_decimal("load", load);
+		snapshot_put_decimal("txutil", stats.tx_utilisation);
+		snapshot_put_decimal("rxutil", stats.rx_utilisation);
+		snapshot_put_decimal("txbps", stats.tx_bytes_per_second);
+		snapshot_put_decimal("rxbps", stats.rx_bytes_per_second);
+		put_char_blocking('\r');
+		put_char_blocking('\n');
+		return;
+
+	}
+
+	put_char_blocking('S');
+	put_char_blocking('N');
+	snapshot_checksum = 0;
+	snapshot_put_byte(SNAPSHOT_VERSION);
+	snapshot_put_byte(SNAPSHOT_SIZE);
+	snapshot_put_byte(features);
+	snapshot_put_byte(serial_config->speed);
+	snapshot_put_word(serial_config->baud);
+	snapshot_put_word(serial_config->baud >> 16);
+	snapshot_put_word(RX_BUFFER_SIZE);
+	snapshot_put_word(TX_BUFFER_SIZE);
+	snapshot_put_byte(state);
+	snapshot_put_word(rx_pending);
+	snapshot_put_word(tx_pending);
+	snapshot_put_word(overflows);
+	snapshot_put_word(frame_errors);
+	snapshot_put_word(ticks);
+	snapshot_put_byte(load);
+	snapshot_put_byte(stats.tx_utilisation);
+	snapshot_put_byte(stats.rx_utilisation);
+	snapshot_put_word(stats.tx_bytes_per_second);
+	snapshot_put_word(stats.rx_bytes_per_second);
+	put_char_blocking(snapshot_checksum);
+
+}
+#endif
+
+#ifdef SERIAL_TRACE
+/************************************************************************
+ * serial_trace_dump: send the ISR trace ring over the link
+ *
+ * Parameters: none
+ *
+ * Returns: nothing
+ *
+ * Entries are sent oldest first. The ring is frozen while it is being
+ * sent, so the dump does not trace itself, and emptied afterwards.
+ ************************************************************************/
+
+extern void serial_trace_dump()
+{
+
+	uint8_t i;
+	uint8_t index;
+	struct trace_entry *entry;
+
+	trace_frozen = 1;
+
+	put_char_blocking('T');
+	put_char_blocking('R');
+	put_char_blocking(TRACE_VERSION);
+	put_char_blocking(trace_count);
+
+	index = (trace_head - trace_count) & (TRACE_BUFFER_SIZE - 1);
+	for (i = 0; i < trace_count; i++) {
+
+		entry = &trace_buffer[index];
+		put_char_blocking(entry->event);
+		put_char_blocking(entry->tick);
+		put_char_blocking(entry->timecount);
+		index = (index + 1) & (TRACE_BUFFER_SIZE - 1);
+
+	}
+
+	trace_count = 0;
+	trace_frozen = 0;
 
 }
+#endif
 
 #ifndef TX_ONLY
 static void wait_buffer_clean(volatile struct buffer *buffer) {
@@ -709,9 +2464,9 @@ extern uint16_t serial_data_pending()
 
 	uint16_t retval = 0;
 
-	if (rx_buffer.top) {
+	if (RX_PENDING) {
 		wait_buffer_clean(&rx_buffer);
-		retval = rx_buffer.top;
+		retval = RX_PENDING;
 	}
 
 	return retval;
@@ -742,6 +2497,291 @@ extern uint8_t serial_get_char()
 
 }
 
+/************************************************************************
+ * serial_peek_char: look at a received byte without consuming it
+ *
+ * Parameters:
+ *		uint16_t offset	Position in the receive buffer
+ *		uint8_t *data	Where to store the byte
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if fewer than offset + 1 bytes are pending
+ *
+ * The receive buffer is kept flush with index 0 by the bottom handler,
+ * so once it is clean, offsets map straight onto rx_buffer.data. The
+ * interrupt only ever appends above top, so bytes below it are stable.
+ ************************************************************************/
+
+extern return_code_t serial_peek_char(uint16_t offset, uint8_t *data)
+{
+
+	wait_buffer_clean(&rx_buffer);
+
+	if (offset >= RX_PENDING)
+		return SERIAL_ERROR;
+
+	*data = rx_buffer.data[offset];
+
+	return SERIAL_OK;
+
+}
+
+/************************************************************************
+ * serial_find_char: find a byte in the receive buffer
+ *
+ * Parameters:
+ *		uint8_t data	The byte to look for
+ *
+ * Returns:
+ *		int16_t offset	Offset of the first occurence, or -1 if not found
+ ************************************************************************/
+
+extern int16_t serial_find_char(uint8_t data)
+{
+
+	uint16_t top;
+	uint8_t *found;
+
+	wait_buffer_clean(&rx_buffer);
+	top = RX_PENDING;
+
+	if ((found = memchr(rx_buffer.data, data, top)) == NULL)
+		return -1;
+
+	return found - rx_buffer.data;
+
+}
+
+/************************************************************************
+ * serial_compare_data: compare the front of the receive buffer
+ *
+ * Parameters:
+ *		uint8_t *prefix		The bytes to compare against
+ *		uint16_t length		Number of bytes in prefix
+ *
+ * Returns:
+ *		SERIAL_OK if the first length pending bytes match prefix
+ *		SERIAL_ERROR on mismatch or if fewer than length bytes are pending
+ ************************************************************************/
+
+extern return_code_t serial_compare_data(uint8_t *prefix, uint16_t length)
+{
+
+	wait_buffer_clean(&rx_buffer);
+
+	if (length > RX_PENDING)
+		return SERIAL_ERROR;
+
+	if (memcmp(rx_buffer.data, prefix, length))
+		return SERIAL_ERROR;
+
+	return SERIAL_OK;
+
+}
+
+/************************************************************************
+ * serial_compare_data_P: serial_compare_data with prefix in flash
+ ************************************************************************/
+
+extern return_code_t serial_compare_data_P(const char *prefix, uint16_t length)
+{
+
+	wait_buffer_clean(&rx_buffer);
+
+	if (length > RX_PENDING)
+		return SERIAL_ERROR;
+
+	if (memcmp_P(rx_buffer.data, prefix, length))
+		return SERIAL_ERROR;
+
+	return SERIAL_OK;
+
+}
+
+/************************************************************************
+ * serial_peek_data: get at received bytes in place
+ *
+ * Parameters:
+ *		uint16_t length	Number of bytes needed
+ *
+ * Returns:
+ *		uint8_t *data	The front of the receive buffer, or NULL
+ *
+ * Only the bottom handler moves the data, and only once it is dirty.
+ ************************************************************************/
+
+extern uint8_t *serial_peek_data(uint16_t length)
+{
+
+	wait_buffer_clean(&rx_buffer);
+
+	if (length > RX_PENDING)
+		return NULL;
+
+	return rx_buffer.data;
+
+}
+
+/************************************************************************
+ * serial_drop_data: take bytes out of the receive buffer
+ *
+ * Parameters:
+ *		uint16_t length	Number of bytes to drop
+ *
+ * Returns:
+ *		uint16_t dropped	Number of bytes dropped
+ *
+ * Hands the bottom handler a count instead of a single byte, so the
+ * buffer is moved down once instead of once per byte.
+ ************************************************************************/
+
+extern uint16_t serial_drop_data(uint16_t length)
+{
+
+	uint16_t dropped = 0;
+	uint16_t count;
+
+	while (dropped < length) {
+
+		wait_buffer_clean(&rx_buffer);
+
+		if ((count = RX_PENDING) == 0)
+			break;
+		if (count > length - dropped)
+			count = length - dropped;
+		if (count > 0xff)
+			count = 0xff;
+
+		rx_buffer.dirty = count;
+		dropped += count;
+
+	}
+
+	return dropped;
+
+}
+
+#ifdef SERIAL_LIN
+/************************************************************************
+ * serial_lin_get_header: get the protected identifier of a LIN header
+ *
+ * Parameters:
+ *		uint8_t *pid	Where to store the PID, as received
+ *		uint8_t *mark	Where to store the number of bytes stored in the
+ *						receive buffer before it, modulo 256
+ *
+ * Returns:
+ *		SERIAL_OK if a header came in since the last call
+ *		SERIAL_ERROR otherwise
+ ************************************************************************/
+
+extern return_code_t serial_lin_get_header(uint8_t *pid, uint8_t *mark)
+{
+
+	return_code_t retval = SERIAL_ERROR;
+
+	cli();
+	if (lin_header) {
+		*pid = lin_pid;
+		*mark = lin_mark;
+		lin_header = 0;
+		retval = SERIAL_OK;
+	}
+	sei();
+
+	return retval;
+
+}
+#endif
+
+#ifdef SERIAL_NMEA
+/************************************************************************
+ * serial_nmea_filter: choose the NMEA sentences to keep
+ *
+ * Parameters:
+ *		const char * const *prefixes	Talker and type prefixes, '?'
+ *						matching any character, e.g. "GPRMC", "??GGA" or
+ *						"GP"
+ *		uint8_t count	Number of prefixes, up to NMEA_MAX_FILTERS. 0
+ *						keeps every sentence with a good checksum.
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if there are too many prefixes
+ ************************************************************************/
+
+extern return_code_t serial_nmea_filter(const char * const *prefixes,
+	uint8_t count)
+{
+
+	if (count > NMEA_MAX_FILTERS)
+		return SERIAL_ERROR;
+
+	cli();
+	nmea_filters = prefixes;
+	nmea_filter_count = count;
+	sei();
+
+	return SERIAL_OK;
+
+}
+#endif
+
+#ifdef SERIAL_9BIT
+/************************************************************************
+ * serial_set_address: set the address for 9 bit multi-drop mode
+ *
+ * Parameters:
+ *		uint8_t address		Our address
+ *
+ * Returns: nothing
+ *
+ * Data is dropped until an address byte with this address comes in.
+ ************************************************************************/
+
+extern void serial_set_address(uint8_t address)
+{
+
+	cli();
+	rx_address = address;
+	rx_addressed = 0;
+	sei();
+
+}
+#endif
+
+#ifdef RX_TIMESTAMPS
+/************************************************************************
+ * serial_peek_timestamp: get the arrival time of a received byte
+ *
+ * Parameters:
+ *		uint16_t offset		Position in the receive buffer
+ *		uint16_t *timestamp	Where to store the tick count
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if fewer than offset + 1 bytes are pending
+ *
+ * Timestamps are written before top is bumped in store_data, so any
+ * byte below top has a valid timestamp.
+ ************************************************************************/
+
+extern return_code_t serial_peek_timestamp(uint16_t offset, uint16_t *timestamp)
+{
+
+	wait_buffer_clean(&rx_buffer);
+
+	if (offset >= RX_PENDING)
+		return SERIAL_ERROR;
+
+	*timestamp = rx_timestamps[offset];
+
+	return SERIAL_OK;
+
+}
+#endif
+
 /************************************************************************
  * (en|dis)able_receive: start or stop listening for incoming data
  *
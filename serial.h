@@ -4,8 +4,24 @@
  * AVR software serial library
  ************************************************************************/
 
+#ifndef RX_BUFFER_SIZE
+#ifdef SERIAL_NMEA
+#define RX_BUFFER_SIZE				128			// A whole sentence and then some
+#else
 #define RX_BUFFER_SIZE				64			// In bytes
+#endif
+#endif
+#ifndef TX_BUFFER_SIZE
 #define TX_BUFFER_SIZE				64			// In bytes
+#endif
+#ifndef TRACE_BUFFER_SIZE
+#define TRACE_BUFFER_SIZE			16			// In entries, power of 2, <= 128
+#endif
+
+// Features that need a running Timer1 tick count
+#if defined(RX_TIMESTAMPS) || defined(SERIAL_TRACE) || defined(SERIAL_LIN)
+#define SERIAL_TICKS
+#endif
 
 typedef enum {
 	SERIAL_ERROR,
@@ -25,15 +41,32 @@ typedef enum {
  * struct serial_init: initialisation structure
  *
  * Members:
- *		char *rx_pin	Pin for receive (standard Pxy format)
- *		char *tx_pin	Pin for transmit (standard Pxy format)
+ *		char *rx_pin	Pin for receive (standard Pxy format), ignored
+ *						when built with TX_ONLY
+ *		char *tx_pin	Pin for transmit (standard Pxy format), ignored
+ *						when built with RX_ONLY
  *		serial_speed_t speed	Serial speed
+ *		uint32_t baud	Any other speed in baud, e.g. 31250 for MIDI.
+ *						0 to use speed instead. Rejected below 8 baud, if
+ *						the timer cannot get within SERIAL_BAUD_TOLERANCE
+ *						of it, or above about 62500 baud at 8MHz, so not
+ *						DMX (250000). Speeds under that limit are not
+ *						checked against what the ISRs cost: run make check
+ *						for the speed and buffer sizes used.
+ *						Building with -DSERIAL_BAUD=<baud> works it out at
+ *						compile time instead, and then both speed and baud
+ *						are ignored.
+ *		char *de_pin	RS-485 driver enable pin (standard Pxy format),
+ *						high while transmitting. Required when built with
+ *						SERIAL_RS485, ignored otherwise
  ************************************************************************/
 
 struct serial_init {
 	char *rx_pin;
 	char *tx_pin;
 	serial_speed_t speed;
+	uint32_t baud;
+	char *de_pin;
 };
 
 /************************************************************************
@@ -58,6 +91,74 @@ struct serial_init {
  
 extern return_code_t serial_initialise(struct serial_init*);
 
+/************************************************************************
+ * serial_deinitialise: tear down connection
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *	  SERIAL_ERROR if not initialised
+ *	  SERIAL_OK otherwise
+ *
+ * This function:
+ *  - Waits for pending TX data to be sent (interrupts must be enabled)
+ *  - Stops the timer and masks the timer and pin change interrupts
+ *  - Releases the pins (inputs, no pullup)
+ *  - Frees the buffers
+ * After this, serial_initialise can be called again.
+ ************************************************************************/
+
+extern return_code_t serial_deinitialise();
+
+/************************************************************************
+ * serial_set_speed: change speed on a running connection
+ *
+ * Parameters: serial_speed_t speed
+ *			The new speed
+ * Returns:
+ *	  SERIAL_ERROR if not initialised or speed is out of range
+ *	  SERIAL_OK otherwise
+ *
+ * Waits for any frame being received to complete and for pending TX
+ * data to be sent, at the old speed and up to the end of its last stop
+ * bit, then switches the timer over atomically. So an acknowledgement
+ * queued before the call reaches the peer intact.
+ ************************************************************************/
+
+extern return_code_t serial_set_speed(serial_speed_t speed);
+
+/************************************************************************
+ * serial_set_speeds: use different speeds for receive and transmit
+ *
+ * Parameters: serial_speed_t rx_speed, serial_speed_t tx_speed
+ *			The new receive and transmit speeds
+ * Returns:
+ *	  SERIAL_ERROR if not initialised or the speeds are not possible
+ *	  SERIAL_OK otherwise
+ *
+ * Both directions run off the one timer, ticking at the faster speed, so
+ * the faster speed has to be a whole multiple of the slower one (all
+ * pairs except 38400 with 57600). Otherwise as serial_set_speed.
+ ************************************************************************/
+
+extern return_code_t serial_set_speeds(serial_speed_t rx_speed, serial_speed_t tx_speed);
+
+/************************************************************************
+ * serial_set_baud: change to a speed given in baud
+ *
+ * Parameters: uint32_t baud
+ *			The new speed, for both directions
+ * Returns:
+ *	  SERIAL_ERROR if not initialised or the speed is not possible (see
+ *	  struct serial_init)
+ *	  SERIAL_OK otherwise
+ *
+ * Otherwise as serial_set_speed.
+ ************************************************************************/
+
+extern return_code_t serial_set_baud(uint32_t baud);
+
+#ifndef RX_ONLY
 /************************************************************************
  * serial_put_char: send a single byte
  *
@@ -71,6 +172,21 @@ extern return_code_t serial_initialise(struct serial_init*);
 
 extern return_code_t serial_put_char(uint8_t data);
 
+/************************************************************************
+ * serial_tx_complete: check whether everything has been sent
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		uint8_t	1 if the TX buffer is empty and the last stop bit has
+ *				been on the line for its full bit time, 0 otherwise
+ *
+ * With -DSERIAL_RS485, the driver enable pin goes low at the same moment,
+ * so the bus can be turned around as soon as this returns 1.
+ ************************************************************************/
+
+extern uint8_t serial_tx_complete();
+
 /************************************************************************
  * serial_send_data: Send multiple byte serial data
  *
@@ -84,6 +200,215 @@ extern return_code_t serial_put_char(uint8_t data);
 
 extern uint16_t serial_send_data(char *data);
 
+/************************************************************************
+ * serial_reserve_data: get the free part of the TX buffer to write into
+ *
+ * Parameters:
+ *		uint16_t *room	Where to store the number of free bytes
+ *
+ * Returns:
+ *		uint8_t *data	Start of the free part
+ *
+ * Locks the TX buffer until serial_commit_data is called. Sending
+ * pauses after the byte on the line, so write quickly and do not call
+ * the other TX functions in between: they would wait for the lock.
+ ************************************************************************/
+
+extern uint8_t *serial_reserve_data(uint16_t *room);
+
+/************************************************************************
+ * serial_commit_data: queue bytes written after serial_reserve_data
+ *
+ * Parameters:
+ *		uint16_t length	Number of bytes written, at most room. 0 sends
+ *						nothing.
+ *
+ * Returns: nothing
+ ************************************************************************/
+
+extern void serial_commit_data(uint16_t length);
+#endif
+
+#ifdef SERIAL_TICKS
+/************************************************************************
+ * serial_get_ticks: get the current Timer1 tick count
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		uint16_t ticks	Number of Timer1 compare matches since
+ *						initialisation. There are two ticks per bit time
+ *						of the faster direction, see serial_get_tick_rate.
+ *						Wraps around, so compare using differences.
+ ************************************************************************/
+
+extern uint16_t serial_get_ticks();
+
+/************************************************************************
+ * serial_get_tick_rate: get the Timer1 tick rate
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		uint32_t rate	Ticks per second at the current speed, twice the
+ *						faster of the RX and TX speeds in baud. 0 if not
+ *						initialised.
+ ************************************************************************/
+
+extern uint32_t serial_get_tick_rate();
+
+#ifndef TX_ONLY
+/************************************************************************
+ * serial_get_rx_bit_ticks: get the length of a received bit
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		uint8_t ticks	Timer1 ticks per received bit: 2, or more if
+ *						serial_set_speeds made RX the slower direction
+ ************************************************************************/
+
+extern uint8_t serial_get_rx_bit_ticks();
+#endif
+#endif
+
+#ifdef SERIAL_LOAD
+/************************************************************************
+ * serial_get_load: CPU share taken by the library's interrupts
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		uint8_t	load	Percentage of CPU time spent in TIM1_COMPA_vect and
+ *						PCINT0_vect over the last 128 bit times. 0 until
+ *						the first window has completed.
+ *
+ * Measured from TCNT1 at ISR entry and exit, so it includes the buffer
+ * shifting in the bottom handler. Stays at 100 when the ISRs overrun
+ * their ticks. Build with -DSERIAL_LOAD.
+ ************************************************************************/
+
+extern uint8_t serial_get_load();
+#endif
+
+#if defined(SERIAL_STATS) || defined(SERIAL_SNAPSHOT)
+/************************************************************************
+ * struct serial_stats: link utilisation and throughput
+ *
+ * Members:
+ *		uint8_t tx_utilisation			% of TX bit slots used
+ *		uint8_t rx_utilisation			% of RX bit slots used, including
+ *										frames with a bad stop bit or lost
+ *										to overflow
+ *		uint16_t tx_bytes_per_second	Bytes sent
+ *		uint16_t rx_bytes_per_second	Bytes stored in the RX buffer
+ ************************************************************************/
+
+struct serial_stats {
+	uint8_t tx_utilisation;
+	uint8_t rx_utilisation;
+	uint16_t tx_bytes_per_second;
+	uint16_t rx_bytes_per_second;
+};
+#endif
+
+#ifdef SERIAL_STATS
+/************************************************************************
+ * serial_get_stats: link utilisation and throughput
+ *
+ * Parameters:
+ *		struct serial_stats *stats	Where to store the figures
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if no window has completed yet
+ *
+ * Figures cover the last completed window of 1/8 s. Build with
+ * -DSERIAL_STATS.
+ ************************************************************************/
+
+extern return_code_t serial_get_stats(struct serial_stats *stats);
+#endif
+
+#ifdef SERIAL_SNAPSHOT
+typedef enum {
+	SERIAL_SNAPSHOT_BINARY,
+	SERIAL_SNAPSHOT_TEXT,
+} serial_snapshot_format_t;
+
+/************************************************************************
+ * serial_send_snapshot: send all counters and configuration
+ *
+ * Parameters:
+ *		serial_snapshot_format_t format	Binary frame or text line
+ *
+ * Returns: nothing
+ *
+ * Takes a consistent copy of the library state and queues it on the TX
+ * buffer, blocking while the buffer is full. Counters of features that
+ * are not built in read 0. Build with -DSERIAL_SNAPSHOT.
+ *
+ * Binary frame (decode with tools/snapshot_decode.py), words little
+ * endian:
+ *		'S' 'N' version size, then size bytes of
+ *		features speed baud(4) rx_buffer_size(2) tx_buffer_size(2) state
+ *		rx_pending(2) tx_pending(2) overflows(2) frame_errors(2) ticks(2)
+ *		load tx_utilisation rx_utilisation tx_bytes_per_second(2)
+ *		rx_bytes_per_second(2)
+ *		followed by the XOR of version, size and those bytes
+ *
+ * speed is the serial_speed_t of the timer, or 0xff for a speed set in
+ * baud. baud is the timer speed in baud either way.
+ *
+ * Text line: "SN v=2 features=... speed=... baud=..." with the same
+ * fields in decimal, ending in CR LF.
+ ************************************************************************/
+
+extern void serial_send_snapshot(serial_snapshot_format_t format);
+#endif
+
+#ifdef SERIAL_ECHO
+/************************************************************************
+ * serial_get_collisions: check for bus contention
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		uint16_t collisions	Number of sent bytes whose echo came back
+ *							garbled or not at all, or that went out while
+ *							another frame was coming in. Wraps around, so
+ *							compare using differences.
+ *
+ * For shared buses (RS-485, single wire) that hear their own
+ * transmission. Build with -DSERIAL_ECHO: bytes received while sending
+ * are checked against what was sent and never reach the receive buffer.
+ * Needs equal RX and TX speeds and the receiver enabled, also on the
+ * transceiver: with RS-485, /RE has to stay low while DE is high. With
+ * /RE tied to DE no echo ever comes back, so every byte sent counts as a
+ * collision. Such a bus does not hear itself: build without SERIAL_ECHO.
+ ************************************************************************/
+
+extern uint16_t serial_get_collisions();
+#endif
+
+#ifdef SERIAL_TRACE
+/************************************************************************
+ * serial_trace_dump: send the ISR trace ring over the link
+ *
+ * Parameters: none
+ *
+ * Returns: nothing
+ *
+ * Queues a trace frame on the TX buffer, blocking while the buffer is
+ * full, then empties the trace ring. Tracing is suspended while dumping.
+ * Frame layout (decode with tools/trace_decode.py):
+ *		'T' 'R' version count, then count entries of
+ *		event tick TCNT1	(one byte each, oldest entry first)
+ ************************************************************************/
+
+extern void serial_trace_dump();
+#endif
+
 #ifndef TX_ONLY
 /************************************************************************
  * serial_data_pending: Check whether any data has been received
@@ -107,6 +432,180 @@ extern uint16_t serial_data_pending();
 
 extern uint8_t serial_get_char();
 
+/************************************************************************
+ * serial_peek_char: look at a received byte without consuming it
+ *
+ * Parameters:
+ *		uint16_t offset	Position in the receive buffer, 0 being the
+ *						byte serial_get_char() would return next
+ *		uint8_t *data	Where to store the byte
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if fewer than offset + 1 bytes are pending
+ ************************************************************************/
+
+extern return_code_t serial_peek_char(uint16_t offset, uint8_t *data);
+
+/************************************************************************
+ * serial_find_char: find a byte in the receive buffer
+ *
+ * Parameters:
+ *		uint8_t data	The byte to look for
+ *
+ * Returns:
+ *		int16_t offset	Offset of the first occurence of data, suitable
+ *						for serial_peek_char(), or -1 if not found
+ ************************************************************************/
+
+extern int16_t serial_find_char(uint8_t data);
+
+/************************************************************************
+ * serial_compare_data: compare the front of the receive buffer
+ *
+ * Parameters:
+ *		uint8_t *prefix		The bytes to compare against
+ *		uint16_t length		Number of bytes in prefix
+ *
+ * Returns:
+ *		SERIAL_OK if the first length pending bytes match prefix
+ *		SERIAL_ERROR on mismatch or if fewer than length bytes are pending
+ ************************************************************************/
+
+extern return_code_t serial_compare_data(uint8_t *prefix, uint16_t length);
+
+/************************************************************************
+ * serial_compare_data_P: compare the front of the receive buffer
+ *
+ * As serial_compare_data, with prefix in flash (PROGMEM)
+ ************************************************************************/
+
+extern return_code_t serial_compare_data_P(const char *prefix, uint16_t length);
+
+/************************************************************************
+ * serial_peek_data: get at received bytes in place
+ *
+ * Parameters:
+ *		uint16_t length	Number of bytes needed
+ *
+ * Returns:
+ *		uint8_t *data	The front of the receive buffer, or NULL if fewer
+ *						than length bytes are pending
+ *
+ * The bytes stay where they are until the next serial_get_char or
+ * serial_drop_data.
+ ************************************************************************/
+
+extern uint8_t *serial_peek_data(uint16_t length);
+
+/************************************************************************
+ * serial_drop_data: take bytes out of the receive buffer
+ *
+ * Parameters:
+ *		uint16_t length	Number of bytes to drop
+ *
+ * Returns:
+ *		uint16_t dropped	Number of bytes dropped, less than length if
+ *							fewer were pending
+ *
+ * Up to 255 bytes go in a single shift of the buffer, where
+ * serial_get_char shifts once per byte.
+ ************************************************************************/
+
+extern uint16_t serial_drop_data(uint16_t length);
+
+#ifdef SERIAL_LIN
+/************************************************************************
+ * serial_lin_get_header: get the protected identifier of a LIN header
+ *
+ * Parameters:
+ *		uint8_t *pid	Where to store the PID, as received
+ *		uint8_t *mark	Where to store the number of bytes the receive
+ *						buffer had taken before the PID, modulo 256
+ *
+ * Returns:
+ *		SERIAL_OK if a header came in since the last call
+ *		SERIAL_ERROR otherwise
+ *
+ * Build with -DSERIAL_LIN. The RX path takes a 0 byte with a bad stop
+ * bit as a break, then times the edges of the 0x55 sync byte to set the
+ * timer to the master's speed. Neither goes into the receive buffer, and
+ * nor does the PID. Bytes after the PID do; a reader that counts the
+ * bytes it takes out can use mark to skip older ones. Used by lin.c.
+ ************************************************************************/
+
+extern return_code_t serial_lin_get_header(uint8_t *pid, uint8_t *mark);
+#endif
+
+#ifdef SERIAL_NMEA
+/************************************************************************
+ * serial_nmea_filter: choose the NMEA sentences to keep
+ *
+ * Parameters:
+ *		const char * const *prefixes	Talker and type prefixes after
+ *						the '$', '?' matching any character: "GPRMC",
+ *						"??GGA", "GP". Must stay valid while receiving.
+ *						A prefix is not read past its terminating 0.
+ *		uint8_t count	Number of prefixes, up to 8. 0 keeps all
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if there are too many prefixes
+ *
+ * Build with -DSERIAL_NMEA to have the RX path check NMEA sentences
+ * while it stores them. Only whole sentences with a good checksum that
+ * match a prefix become pending, stored as "$...*hh\n" without the CR
+ * LF. Everything else is taken off the receive buffer again in the ISR,
+ * unwanted types after their first few characters, so serial_find_char
+ * ('\n') finds the end of the next good sentence.
+ *
+ * A sentence can be 82 characters up to its checksum, plus the '\n', so
+ * RX_BUFFER_SIZE has to be at least 83 or the build stops. Under
+ * SERIAL_NMEA it defaults to 128.
+ ************************************************************************/
+
+extern return_code_t serial_nmea_filter(const char * const *prefixes,
+	uint8_t count);
+#endif
+
+#ifdef SERIAL_9BIT
+/************************************************************************
+ * serial_set_address: set our address for 9 bit multi-drop mode
+ *
+ * Parameters:
+ *		uint8_t address		Our address
+ *
+ * Returns: nothing
+ *
+ * Build with -DSERIAL_9BIT for 9N1 frames, the 9th bit marking address
+ * bytes. Received data bytes are dropped in the ISR, before they reach
+ * the receive buffer, unless the last address byte was ours. Address
+ * bytes themselves are not stored. Everything is dropped until the
+ * first matching address byte. Bytes sent have the 9th bit 0, so this
+ * is for slaves only.
+ ************************************************************************/
+
+extern void serial_set_address(uint8_t address);
+#endif
+
+#ifdef RX_TIMESTAMPS
+/************************************************************************
+ * serial_peek_timestamp: get the arrival time of a received byte
+ *
+ * Parameters:
+ *		uint16_t offset		Position in the receive buffer, as for
+ *							serial_peek_char()
+ *		uint16_t *timestamp	Where to store the tick count at which the
+ *							stop bit of the byte was accepted
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if fewer than offset + 1 bytes are pending
+ ************************************************************************/
+
+extern return_code_t serial_peek_timestamp(uint16_t offset, uint16_t *timestamp);
+#endif
+
 /************************************************************************
  * (en|dis)able_receive: start or stop listening for incoming data
  *
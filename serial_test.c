@@ -17,6 +17,8 @@ int main(void)
 	serial_init->rx_pin = "PB1";
 	serial_init->tx_pin = "PB2";
 	serial_init->speed = SERIAL_SPEED_9600;
+	serial_init->baud = 0;
+	serial_init->de_pin = "PB3";	// Only used with -DSERIAL_RS485
 
 	
 
@@ -26,6 +28,7 @@ int main(void)
 		while (0) {
 		}
 
+#ifndef RX_ONLY
 		// Test 2: write single character
 		while (0) {
 			serial_put_char(0x55);
@@ -38,6 +41,9 @@ int main(void)
 			_delay_ms(100);
 		}
 
+#endif
+
+#if !defined(TX_ONLY) && !defined(RX_ONLY)
 		// Test 4: two way communication
 		serial_enable_receive();
 		while (1) {
@@ -47,6 +53,19 @@ int main(void)
 				_delay_ms(100);
 			}
 		}
+#endif
+
+#ifdef RX_ONLY
+		// Test 5: receive only, toggle PB0 for every byte
+		serial_enable_receive();
+		while (1) {
+			if (serial_data_pending()) {
+
+				serial_get_char();
+				PORTB ^= (1 << PB0);
+			}
+		}
+#endif
 
 	}
 
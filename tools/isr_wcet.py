@@ -0,0 +1,297 @@
+#!/usr/bin/env python3
+"""
+libserial ISR worst case execution time analysis
+
+Reads `avr-objdump -d` output, builds the control flow graph of each
+interrupt handler (following calls into other functions) and reports the
+longest path in CPU cycles. Cycle counts are those of the AVRe core used
+in the ATTinyx5 (datasheet / AVR instruction set manual).
+
+Both TIM1_COMPA_vect and PCINT0_vect can run in the same timer tick, so
+the sum of their worst cases, plus interrupt response time, has to fit in
+one tick (half a bit time). If it does not, the exit status is 1.
+
+Loops are not bounded by the code itself (the buffer shifts loop over
+the buffer contents), so every loop is assumed to iterate --loop-bound
+times. By default that is the larger of the buffers the configuration
+shifts in the ISR: RX_BUFFER_SIZE, TX_BUFFER_SIZE or both. The result is
+an upper bound, not an exact figure.
+
+Usage: avr-objdump -d main.elf | isr_wcet.py --f-cpu 8000000 --baud 9600 \
+           --rx-buffer-size 64 --tx-buffer-size 64 --config="$(DEFINES)"
+"""
+
+import argparse
+import re
+import sys
+
+# ATTinyx5 vector numbers (datasheet table 9-1, minus the reset vector)
+VECTORS = {
+    "PCINT0_vect": 2,
+    "TIM1_COMPA_vect": 3,
+}
+
+# Interrupt response: 4 cycles to enter, 2 for the rjmp in the vector table
+INTERRUPT_RESPONSE = 6
+
+CYCLES = {
+    2: "adiw sbiw ld ldd lds st std sts push pop sbi cbi rjmp ijmp",
+    3: "lpm elpm rcall icall jmp",
+    4: "call ret reti",
+}
+CYCLES = {m: c for c, names in CYCLES.items() for m in names.split()}
+
+ONE_CYCLE = set("""
+    add adc sub subi sbc sbci and andi or ori eor com neg sbr cbr inc dec
+    tst clr ser mov movw ldi in out lsl lsr rol ror asr swap bset bclr bst
+    bld sec clc sen cln sez clz sei cli ses cls sev clv set clt seh clh nop
+    sleep wdr cp cpc cpi
+""".split())
+
+SKIPS = set("cpse sbrc sbrs sbic sbis".split())
+
+LINE = re.compile(r"^\s*([0-9a-f]+):\s+((?:[0-9a-f]{2} )+)\s*(\S+)\s*([^;]*)(?:;\s*(.*))?$")
+TARGET = re.compile(r"0x([0-9a-f]+)")
+
+
+class Instruction:
+
+    def __init__(self, address, size, mnemonic, operands, comment):
+        self.address = address
+        self.size = size
+        self.mnemonic = mnemonic
+        self.operands = operands.strip()
+        self.comment = comment or ""
+
+    @property
+    def next(self):
+        return self.address + self.size
+
+    def target(self):
+        # objdump puts the absolute target in the comment for relative
+        # jumps, and in the operand for absolute ones
+        match = TARGET.search(self.comment) or TARGET.search(self.operands)
+        if not match:
+            raise ValueError("no target for %s at 0x%x" % (self.mnemonic, self.address))
+        return int(match.group(1), 16)
+
+
+def parse(lines):
+    program = {}
+    for line in lines:
+        match = LINE.match(line)
+        if not match:
+            continue
+        address, raw, mnemonic, operands, comment = match.groups()
+        program[int(address, 16)] = Instruction(
+            int(address, 16), len(raw.split()), mnemonic, operands, comment)
+    return program
+
+
+class Analyser:
+
+    def __init__(self, program, loop_bound):
+        self.program = program
+        self.loop_bound = loop_bound
+        self.functions = {}
+        self.active = set()
+
+    def cost(self, insn):
+        """Cycles of an instruction on its fall through path, plus callee"""
+        m = insn.mnemonic
+        if m in ONE_CYCLE or m in SKIPS or m.startswith("br"):
+            return 1
+        if m in ("rcall", "call"):
+            return CYCLES[m] + self.wcet(insn.target())
+        if m in ("icall", "ijmp"):
+            raise ValueError("indirect %s at 0x%x cannot be analysed" % (m, insn.address))
+        if m not in CYCLES:
+            sys.stderr.write("warning: unknown instruction %s, assuming 2 cycles\n" % m)
+        return CYCLES.get(m, 2)
+
+    def successors(self, insn):
+        """(address, extra cycles) pairs"""
+        m = insn.mnemonic
+        if m in ("ret", "reti"):
+            return []
+        if m in ("rjmp", "jmp"):
+            return [(insn.target(), 0)]
+        if m.startswith("br") and m != "break":
+            return [(insn.next, 0), (insn.target(), 1)]
+        if m in SKIPS:
+            skipped = self.program[insn.next]
+            return [(insn.next, 0), (skipped.next, skipped.size // 2)]
+        return [(insn.next, 0)]
+
+    def wcet(self, entry):
+        """Worst case cycles from entry until ret/reti"""
+        if entry in self.functions:
+            return self.functions[entry]
+        if entry in self.active:
+            raise ValueError("recursion through 0x%x" % entry)
+        self.active.add(entry)
+
+        # Collect the graph and find back edges with a depth first search
+        edges = {}
+        back_edges = []
+        state = {}
+        state[entry] = "open"
+        edges[entry] = self.successors(self.program[entry])
+        stack = [(entry, iter(edges[entry]))]
+        while stack:
+            node, children = stack[-1]
+            for child, extra in children:
+                if child not in state:
+                    state[child] = "open"
+                    edges[child] = self.successors(self.program[child])
+                    stack.append((child, iter(edges[child])))
+                    break
+                if state[child] == "open":
+                    back_edges.append((node, child, extra))
+            else:
+                state[node] = "done"
+                stack.pop()
+
+        back = {(u, v) for u, v, _ in back_edges}
+        forward = {u: [(v, e) for v, e in vs if (u, v) not in back]
+                   for u, vs in edges.items()}
+        costs = {a: self.cost(self.program[a]) for a in edges}
+
+        # Topological order of the acyclic part
+        order = []
+        seen = set()
+
+        def visit(node):
+            seen.add(node)
+            for child, _ in forward[node]:
+                if child not in seen:
+                    visit(child)
+            order.append(node)
+
+        visit(entry)
+        order.reverse()
+
+        def longest(start, end=None):
+            """Longest path from start, to end (inclusive) or to any exit"""
+            best = {start: 0}
+            result = 0
+            for node in order:
+                if node not in best:
+                    continue
+                here = best[node] + costs[node]
+                if node == end or (end is None and not forward[node]):
+                    result = max(result, here)
+                for child, extra in forward[node]:
+                    best[child] = max(best.get(child, -1), here + extra)
+            return result
+
+        # Every loop runs loop_bound times; the acyclic path already
+        # contains one pass. Inner loops are charged again for every
+        # iteration of loops around them.
+        loops = {}
+        for source, header, extra in back_edges:
+            body = longest(header, source) + extra
+            loops[header] = max(loops.get(header, 0), body)
+
+        def body_nodes(header):
+            nodes = set()
+            for source, h, _ in back_edges:
+                if h != header:
+                    continue
+                work = [source]
+                while work:
+                    node = work.pop()
+                    if node in nodes:
+                        continue
+                    nodes.add(node)
+                    if node != header:
+                        work.extend(u for u, vs in forward.items()
+                                    if any(v == node for v, _ in vs))
+            return nodes
+
+        bodies = {h: body_nodes(h) for h in loops}
+        extra_cycles = {}
+        for header in sorted(loops, key=lambda h: len(bodies[h])):
+            inner = sum(extra_cycles[h] for h in extra_cycles
+                        if h != header and h in bodies[header])
+            extra_cycles[header] = (self.loop_bound - 1) * (loops[header] + inner)
+        total = longest(entry)
+        outermost = [h for h in loops
+                     if not any(h in bodies[o] for o in loops if o != h)]
+        total += sum(extra_cycles[h] for h in outermost)
+
+        self.active.discard(entry)
+        self.functions[entry] = total
+        return total
+
+
+def find_vector(program, lines, number):
+    label = re.compile(r"^([0-9a-f]+) <__vector_%d>:" % number)
+    for line in lines:
+        match = label.match(line)
+        if match:
+            return int(match.group(1), 16)
+    return None
+
+
+def loop_bound(config, rx_buffer_size, tx_buffer_size):
+    """Longest buffer shift the ISR can do in this configuration"""
+    flags = config.split()
+    if "-DTX_ONLY" in flags:
+        return tx_buffer_size
+    if "-DRX_ONLY" in flags:
+        return rx_buffer_size
+    return max(rx_buffer_size, tx_buffer_size)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Worst case ISR cycle counts")
+    parser.add_argument("disassembly", nargs="?", help="avr-objdump -d output (default stdin)")
+    parser.add_argument("--f-cpu", type=int, default=8000000)
+    parser.add_argument("--baud", type=int, default=9600)
+    parser.add_argument("--rx-buffer-size", type=int, default=64,
+                        help="RX_BUFFER_SIZE of the build (default: 64, as serial.h)")
+    parser.add_argument("--tx-buffer-size", type=int, default=64,
+                        help="TX_BUFFER_SIZE of the build (default: 64, as serial.h)")
+    parser.add_argument("--loop-bound", type=int,
+                        help="iterations assumed for every loop (default: the largest buffer shifted)")
+    parser.add_argument("--config", default="default",
+                        help="label for the report, the build's -D flags")
+    args = parser.parse_args()
+
+    if args.loop_bound is None:
+        args.loop_bound = loop_bound(args.config, args.rx_buffer_size,
+                                     args.tx_buffer_size)
+
+    if args.disassembly:
+        with open(args.disassembly) as f:
+            lines = f.readlines()
+    else:
+        lines = sys.stdin.readlines()
+
+    program = parse(lines)
+    analyser = Analyser(program, args.loop_bound)
+
+    # Two timer ticks per bit
+    tick = args.f_cpu // (2 * args.baud)
+    total = 0
+    print("config %s, %d baud at %d Hz: %d cycles per tick, loops %d times"
+          % (args.config or "default", args.baud, args.f_cpu, tick, args.loop_bound))
+    for name, number in VECTORS.items():
+        entry = find_vector(program, lines, number)
+        if entry is None:
+            print("  %-16s not present" % name)
+            continue
+        cycles = analyser.wcet(entry) + INTERRUPT_RESPONSE
+        total += cycles
+        print("  %-16s %6d cycles" % (name, cycles))
+    print("  %-16s %6d cycles (%d%% of tick)" % ("both", total, 100 * total // tick))
+
+    if total > tick:
+        print("error: worst case exceeds the tick period")
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
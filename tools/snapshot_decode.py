@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+"""
+libserial snapshot decoder
+
+Decodes the frames sent by serial_send_snapshot() (build with
+-DSERIAL_SNAPSHOT) from a raw capture, a file or stdin, and prints one
+line of key=value pairs per snapshot, the same keys as the text format.
+Snapshot versions 1 and 2 are understood.
+Frames with a bad checksum are reported and skipped.
+
+Usage: snapshot_decode.py [capture_file]
+"""
+
+import struct
+import sys
+
+# Fields per snapshot version. Version 2 added the timer speed in baud,
+# which version 1 only had as a serial_speed_t
+FIELDS_V1 = [
+    ("features", "B"), ("speed", "B"), ("rxsize", "H"), ("txsize", "H"),
+    ("state", "B"), ("rxpending", "H"), ("txpending", "H"),
+    ("overflows", "H"), ("frameerrors", "H"), ("ticks", "H"), ("load", "B"),
+    ("txutil", "B"), ("rxutil", "B"), ("txbps", "H"), ("rxbps", "H"),
+]
+FIELDS = {
+    1: FIELDS_V1,
+    2: FIELDS_V1[:2] + [("baud", "I")] + FIELDS_V1[2:],
+}
+FORMATS = {v: "<" + "".join(f for _, f in fields) for v, fields in FIELDS.items()}
+
+FEATURES = ["tx_only", None, "timestamps", "trace", "load", "stats"]
+SPEEDS = [2400, 9600, 19200, 38400, 57600, 115200]
+
+
+def snapshots(data):
+    """Yield (fields, checksum ok) for every frame in data"""
+    i = 0
+    while True:
+        i = data.find(b"SN", i)
+        if i < 0 or i + 4 > len(data):
+            return
+        version, size = data[i + 2], data[i + 3]
+        end = i + 4 + size + 1
+        if version not in FORMATS or size != struct.calcsize(FORMATS[version]) \
+                or end > len(data):
+            i += 2
+            continue
+        checksum = 0
+        for byte in data[i + 2:end]:
+            checksum ^= byte
+        values = struct.unpack(FORMATS[version], data[i + 4:end - 1])
+        fields = dict(zip((name for name, _ in FIELDS[version]), values))
+        fields["v"] = version
+        yield fields, checksum == 0
+        i = end
+
+
+def main():
+    if len(sys.argv) > 1:
+        with open(sys.argv[1], "rb") as f:
+            data = f.read()
+    else:
+        data = sys.stdin.buffer.read()
+
+    for fields, ok in snapshots(data):
+        if not ok:
+            print("bad checksum, skipped")
+            continue
+        features = [name for bit, name in enumerate(FEATURES)
+                    if name and fields["features"] & (1 << bit)]
+        line = " ".join("%s=%d" % (name, fields[name])
+                        for name, _ in FIELDS[fields["v"]])
+        if "baud" not in fields:
+            # Version 1 has no baud for speeds set with serial_set_baud
+            baud = SPEEDS[fields["speed"]] if fields["speed"] < len(SPEEDS) else "?"
+            line += " baud=%s" % baud
+        print("v=%d %s [%s]" % (fields["v"], line, ",".join(features)))
+
+
+if __name__ == "__main__":
+    main()
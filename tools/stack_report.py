@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+"""
+libserial stack and register pressure report
+
+Combines the -fstack-usage output of the build (*.su) with `avr-objdump -d`
+output. For every interrupt handler it lists the registers saved in its
+prologue and the deepest stack it can reach through its calls, then works
+out the worst case stack depth of the whole program: main at its deepest
+point, interrupted by TIM1_COMPA_vect, interrupted in turn by PCINT0_vect.
+
+The ISRs in serial.c do not re-enable interrupts, so the nested figure is
+only reached if one of them is changed to ISR_NOBLOCK. Both are printed.
+
+On AVR, the .su figures include the return address and pushed registers.
+
+Usage: avr-objdump -d main.elf | stack_report.py serial.su serial_test.su
+"""
+
+import argparse
+import re
+import sys
+
+VECTORS = {
+    "PCINT0_vect": "__vector_2",
+    "TIM1_COMPA_vect": "__vector_3",
+}
+
+LABEL = re.compile(r"^([0-9a-f]+) <([^>]+)>:")
+INSN = re.compile(r"^\s*[0-9a-f]+:\s+(?:[0-9a-f]{2} )+\s*(\S+)\s*([^;]*)(?:;\s*0x[0-9a-f]+ <([^>+]+)>)?")
+
+
+def read_stack_usage(paths):
+    """Function name -> (bytes, qualifier)"""
+    usage = {}
+    for path in paths:
+        with open(path) as f:
+            for line in f:
+                location, size, qualifier = line.rstrip("\n").split("\t")
+                usage[location.split(":")[-1]] = (int(size), qualifier)
+    return usage
+
+
+def read_functions(lines):
+    """Function name -> (pushed registers, called functions)"""
+    functions = {}
+    current = None
+    prologue = False
+    for line in lines:
+        match = LABEL.match(line)
+        if match:
+            current = match.group(2)
+            functions[current] = ([], set())
+            prologue = True
+            continue
+        match = INSN.match(line)
+        if not match or current is None:
+            continue
+        mnemonic, operands, target = match.groups()
+        pushes, calls = functions[current]
+        if mnemonic == "push" and prologue:
+            pushes.append(operands.strip())
+        elif mnemonic not in ("in", "eor", "clr"):
+            # ISR prologues save SREG through r0 in between pushes
+            prologue = False
+        if mnemonic in ("rcall", "call") and target:
+            calls.add(target)
+    return functions
+
+
+class Report:
+
+    def __init__(self, usage, functions):
+        self.usage = usage
+        self.functions = functions
+        self.unknown = set()
+
+    def depth(self, name, active=()):
+        """Deepest stack reached by name, including its own frame"""
+        if name in active:
+            raise ValueError("recursion through %s" % name)
+        if name in self.usage:
+            own = self.usage[name][0]
+            if self.usage[name][1] != "static":
+                self.unknown.add(name)
+        else:
+            # Library routines (libgcc, avr-libc) have no .su entry; charge
+            # their pushes plus the return address
+            own = 2 + len(self.functions.get(name, ([], ()))[0])
+            self.unknown.add(name)
+        calls = self.functions.get(name, ([], set()))[1]
+        return own + max([self.depth(c, active + (name,)) for c in calls] or [0])
+
+
+def main():
+    parser = argparse.ArgumentParser(description="ISR stack and register report")
+    parser.add_argument("su", nargs="+", help="-fstack-usage output files")
+    parser.add_argument("--disassembly", help="avr-objdump -d output (default stdin)")
+    parser.add_argument("--ram", type=int, default=512, help="SRAM size in bytes")
+    args = parser.parse_args()
+
+    if args.disassembly:
+        with open(args.disassembly) as f:
+            lines = f.readlines()
+    else:
+        lines = sys.stdin.readlines()
+
+    report = Report(read_stack_usage(args.su), read_functions(lines))
+
+    main_depth = report.depth("main")
+    print("  %-16s %4d bytes" % ("main", main_depth))
+
+    isr_depths = {}
+    for name, symbol in VECTORS.items():
+        if symbol not in report.functions:
+            print("  %-16s not present" % name)
+            continue
+        pushes = report.functions[symbol][0]
+        isr_depths[name] = report.depth(symbol)
+        print("  %-16s %4d bytes, %2d registers saved: %s"
+              % (name, isr_depths[name], len(pushes), " ".join(pushes)))
+
+    serialised = main_depth + max(isr_depths.values() or [0])
+    nested = main_depth + sum(isr_depths.values())
+    print("  worst case stack %4d bytes (%d if the ISRs nest)" % (serialised, nested))
+    print("  left of %d bytes SRAM for data, bss and heap: %d" % (args.ram, args.ram - nested))
+
+    if report.unknown:
+        print("  note: estimated or dynamic frames in %s" % ", ".join(sorted(report.unknown)))
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+"""
+libserial trace decoder
+
+Decodes trace frames sent by serial_trace_dump() (build with -DSERIAL_TRACE).
+Reads raw bytes captured from the link, from a file or stdin, and prints one
+line per trace entry. Anything between frames (normal traffic) is skipped.
+
+Usage: trace_decode.py [capture_file] [--ocr N]
+
+    --ocr N     Timer1 OCR value for the link speed (52 for 9600 baud at
+                8 MHz), used to print times in bit fractions
+"""
+
+import argparse
+import sys
+
+TRACE_VERSION = 1
+ENTRY_SIZE = 3
+
+EVENTS = {
+    0x1: "start bit",
+    0x2: "spurious start bit",
+    0x3: "sample",
+    0x4: "stop bit ok",
+    0x5: "stop bit bad",
+    0x6: "receive overflow",
+    0x7: "tx lock retry",
+}
+
+
+def describe(event):
+    kind = event >> 4
+    name = EVENTS.get(kind, "unknown 0x%02x" % event)
+    if kind == 0x3:
+        return "%s bit %d = %d" % (name, (event >> 1) & 0x7, event & 1)
+    return name
+
+
+def frames(data):
+    """Yield lists of (event, tick, timecount) tuples, one per frame"""
+    i = 0
+    while True:
+        i = data.find(b"TR", i)
+        if i < 0 or i + 4 > len(data):
+            return
+        version, count = data[i + 2], data[i + 3]
+        end = i + 4 + count * ENTRY_SIZE
+        if version != TRACE_VERSION or end > len(data):
+            i += 2
+            continue
+        body = data[i + 4:end]
+        yield [tuple(body[j:j + ENTRY_SIZE])
+               for j in range(0, len(body), ENTRY_SIZE)]
+        i = end
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode libserial traces")
+    parser.add_argument("capture", nargs="?", help="raw capture (default stdin)")
+    parser.add_argument("--ocr", type=int, help="Timer1 OCR value")
+    args = parser.parse_args()
+
+    if args.capture:
+        with open(args.capture, "rb") as f:
+            data = f.read()
+    else:
+        data = sys.stdin.buffer.read()
+
+    for n, entries in enumerate(frames(data)):
+        print("frame %d: %d entries" % (n, len(entries)))
+        first = None
+        for event, tick, timecount in entries:
+            if first is None:
+                first = tick
+            # Ticks are the low byte of serial_ticks, so only differences
+            # within 256 ticks are meaningful
+            delta = (tick - first) & 0xff
+            line = "  tick %+4d tcnt %3d  %s" % (delta, timecount, describe(event))
+            if args.ocr:
+                line += "  (t = %.2f bit)" % ((delta + timecount / (args.ocr + 1.0)) / 2)
+            print(line)
+
+
+if __name__ == "__main__":
+    main()